@@ -71,7 +71,10 @@ bool atl_get_mapping(std::shared_ptr<fib_data> handle,
         return false;
     if(!handle->is_qsdr)
     {
-        std::cout << "Conduct spatial warping with norm factor of " << factor << std::endl;
+        handle->cache_mni_mapping = po.get("cache_mapping",int(1));
+        handle->embed_mni_mapping = po.get("embed_mapping",int(0));
+        std::cout << "Spatial warping with norm factor of " << factor << std::endl;
+        // reuses the stored mapping when cache_mapping is on
         handle->run_normalization(factor,false/*not background*/);
     }
     handle->get_mni_mapping(mapping);
@@ -89,8 +92,15 @@ void atl_save_mapping(const std::string& file_name,const image::geometry<3>& geo
         std::string base_name = file_name;
         base_name += ".";
         base_name += atlas_list[i].name;
+        image::basic_image<uint64_t,3> label_volume;
+        std::vector<std::vector<unsigned int> > region_voxels;
+        atlas_list[i].get_label_volume(mapping,label_volume);
+        atlas_list[i].get_region_voxels(label_volume,region_voxels);
         image::basic_image<short,3> all_roi(geo);
-        for(unsigned int j = 0;j < atlas_list[i].get_list().size();++j)
+        for(unsigned int j = 0;j < region_voxels.size();++j)
+            for(unsigned int k = 0;k < region_voxels[j].size();++k)
+                all_roi[region_voxels[j][k]] = label_volume[region_voxels[j][k]];
+        for(unsigned int j = 0;multiple && j < region_voxels.size();++j)
         {
             std::string output = base_name;
             output += ".";
@@ -98,24 +108,17 @@ void atl_save_mapping(const std::string& file_name,const image::geometry<3>& geo
             output += ".nii.gz";
 
             image::basic_image<unsigned char,3> roi(geo);
-            for(unsigned int k = 0;k < mapping.size();++k)
-                if (atlas_list[i].is_labeled_as(mapping[k], j))
-                {
-                    roi[k] = 1;
-                    all_roi[k] = atlas_list[i].get_label_at(mapping[k]);
-                }
-            if(multiple)
-            {
-                image::io::nifti out;
-                out.set_voxel_size(vs);
-                if(!trans.empty())
-                    out.set_image_transformation(trans.begin());
-                else
-                    image::flip_xy(roi);
-                out << roi;
-                out.save_to_file(output.c_str());
-                std::cout << "save " << output << std::endl;
-            }
+            for(unsigned int k = 0;k < region_voxels[j].size();++k)
+                roi[region_voxels[j][k]] = 1;
+            image::io::nifti out;
+            out.set_voxel_size(vs);
+            if(!trans.empty())
+                out.set_image_transformation(trans.begin());
+            else
+                image::flip_xy(roi);
+            out << roi;
+            out.save_to_file(output.c_str());
+            std::cout << "save " << output << std::endl;
         }
         {
             std::string label_name = base_name;
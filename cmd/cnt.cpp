@@ -117,8 +117,12 @@ int cnt(void)
     }    
     vbc->ui->length_threshold->setValue(po.get("track_length",int(40)));
     std::cout << "track_length=" << vbc->ui->length_threshold->value() << std::endl;
+    if(po.has("checkpoint"))
+        vbc->checkpoint_file = po.get("checkpoint");
     std::cout << "running connectometry" << std::endl;
     vbc->on_run_clicked();
+    if(!vbc->vbc->checkpoint_file.empty())
+        std::cout << "checkpoint=" << vbc->vbc->checkpoint_file << std::endl;
     for(int i = 0;i < vbc->vbc->threads.size();++i)
         vbc->vbc->threads[i]->wait();
     std::cout << "output results" << std::endl;
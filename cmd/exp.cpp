@@ -35,6 +35,22 @@ int exp(void)
         return 1;
     }
 
+    if(po.get("export") == "mmap")
+    {
+        std::string file_name = po.get("source");
+        std::string output_name = file_name;
+        if(output_name.length() > 3 && output_name.substr(output_name.length()-3) == ".gz")
+            output_name.erase(output_name.length()-3);
+        output_name += ".mm";
+        std::cout << "converting to memory-mapped container " << output_name << std::endl;
+        if(!convert_to_mmap_mat(file_name.c_str(),output_name.c_str(),po.get("compress",int(0))))
+        {
+            std::cout << "Cannot convert " << file_name << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     gz_mat_read mat_reader;
     std::string file_name = po.get("source");
     std::cout << "loading " << file_name << "..." <<std::endl;
@@ -151,9 +151,12 @@ int rec(void)
     handle->voxel.odf_decomposition = po.get("decomposition",int(0));
     handle->voxel.max_fiber_number = po.get("num_fiber",int(5));
     handle->voxel.r2_weighted = po.get("r2_weighted",int(0));
+    handle->voxel.kernel_accuracy = po.get("kernel_accuracy",float(0.000001));
     handle->voxel.reg_method = po.get("reg_method",int(0));
     handle->voxel.interpo_method = po.get("interpo_method",int(2));
     handle->voxel.csf_calibration = po.get("csf_calibration",int(0)) && method_index == 4;
+    handle->interleave_dwi = po.get("interleave_dwi",int(1));
+    handle->voxel.block_size = po.get("block_size",int(32));
 
     std::vector<unsigned int> shell;
     calculate_shell(handle->voxel.bvalues,shell);
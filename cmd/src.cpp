@@ -9,7 +9,7 @@
 QStringList search_files(QString dir,QString filter);
 void load_bval(const char* file_name,std::vector<double>& bval);
 void load_bvec(const char* file_name,std::vector<double>& b_table);
-bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
+bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool defer_image,unsigned int thread_count);
 int src(void)
 {
     std::string source = po.get("source");
@@ -55,7 +55,9 @@ int src(void)
         return -1;
     }
 
-    if(!load_all_files(file_list,dwi_files))
+    // images are read one at a time when the SRC file is written
+    if(!load_all_files(file_list,dwi_files,po.get("stream",int(1)),
+                      po.get("thread_count",int(std::thread::hardware_concurrency()))))
     {
         std::cout << "Invalid file format" << std::endl;
         return -1;
@@ -132,6 +134,10 @@ int src(void)
         return 1;
     }
     std::cout << "Output src to " << output << std::endl;
-    DwiHeader::output_src(output.c_str(),dwi_files,0);
+    if(!DwiHeader::output_src(output.c_str(),dwi_files,0,po.get("output_t2",int(0))))
+    {
+        std::cout << "Failed to output src" << std::endl;
+        return 1;
+    }
     return 0;
 }
@@ -257,7 +257,7 @@ int trk(void)
         tracking_thread.param.min_points_count3 = 6;
     tracking_thread.param.max_points_count3 = std::max<unsigned int>(6,3.0*po.get("max_length",float(500))/tracking_thread.param.step_size);
 
-    tracking_thread.tracking_method = po.get("method",int(0));
+    tracking_thread.tracking_method = po.get("method",int(0));// 0:streamline 1:rk4 2:voxel 3:batched streamline
     tracking_thread.initial_direction  = po.get("initial_dir",int(0));
     tracking_thread.interpolation_strategy = po.get("interpolation",int(0));
     tracking_thread.center_seed = po.get("seed_plan",int(0));
@@ -9,6 +9,8 @@
 #include "prog_interface_static_link.h"
 #include "libs/gzip_interface.hpp"
 #include "motion_dialog.hpp"
+#include <atomic>
+#include <thread>
 
 
 
@@ -309,7 +311,7 @@ bool load_4d_2dseq(const char* file_name,std::vector<std::shared_ptr<DwiHeader>
     return true;
 }
 
-bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
+bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool defer_image,unsigned int thread_count)
 {
     image::io::dicom dicom_header;// multiple frame image
     image::geometry<3> geo;
@@ -330,8 +332,8 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
     if(s1 == 0.0) // no slice locaton information
     {
         DwiHeader dwi1,dwi2;
-        dwi1.open(file_list[0].toLocal8Bit().begin());
-        dwi2.open(file_list[1].toLocal8Bit().begin());
+        dwi1.open(dicom_header);
+        dwi2.open(dicom_header2);
         if(dwi1.bvec == dwi2.bvec && dwi1.bvalue == dwi2.bvalue) // iterater slice first
         {
             for (;slice_num < file_list.size();++slice_num)
@@ -389,55 +391,82 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
         }
     }
 
-    if(iterate_slice_first)
+    // each file is read once: its pixels go to their slice of the DWI, and
+    // the first slice of each DWI also provides the b-table. A deferred DWI
+    // only records its slice files, which are read when the DWI is written.
+    std::vector<std::string> file_names(file_list.size());
+    for (unsigned int index = 0;index < file_list.size();++index)
+        file_names[index] = file_list[index].toLocal8Bit().begin();
+    unsigned int dwi_count = iterate_slice_first ? (file_names.size()+slice_num-1)/slice_num :
+                                                   std::min<unsigned int>(b_num,file_names.size());
+    std::vector<std::shared_ptr<DwiHeader> > new_files(dwi_count);
+    for (unsigned int index = 0;index < dwi_count;++index)
     {
-        for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
+        new_files[index] = std::make_shared<DwiHeader>();
+        if(defer_image)
         {
-            if(!dicom_header2.load_from_file(file_list[index].toLocal8Bit().begin()))
-                return false;
-            if(slice_index == 0)
-            {
-                dwi_files.push_back(std::make_shared<DwiHeader>());
-                dwi_files.back()->open(file_list[index].toLocal8Bit().begin());
-                dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-                dwi_files.back()->image.resize(geo);
-                dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-            }
-            dicom_header2.save_to_buffer(
-                    dwi_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
-            ++slice_index;
-            if(slice_index >= slice_num)
-            {
-                slice_index = 0;
-                ++b_index;
-            }
+            new_files[index]->source_geometry = geo;
+            new_files[index]->source_files.resize(geo[2]);
         }
+        else
+            new_files[index]->image.resize(geo);
+        dicom_header.get_voxel_size(new_files[index]->voxel_size);
     }
-    else
+    if(defer_image)
+        for (unsigned int index = 0;index < file_names.size();++index)
+        {
+            unsigned int b_index = iterate_slice_first ? index/slice_num : index%b_num;
+            unsigned int slice_index = iterate_slice_first ? index%slice_num : index/b_num;
+            if(slice_index < geo[2])
+                new_files[b_index]->source_files[slice_index] = file_names[index];
+        }
+    begin_prog("loading images");
+    std::atomic<bool> failed(false);
+    image::par_for2(file_names.size(),[&](int index,int thread_index)
     {
-        begin_prog("loading images");
-        for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
+        if(failed)
+            return;
+        if(thread_index == 0)
         {
-            if(!dicom_header2.load_from_file(file_list[index].toLocal8Bit().begin()))
-                return false;
-            if(slice_index == 0)
-            {
-                dwi_files.push_back(std::make_shared<DwiHeader>());
-                dwi_files.back()->open(file_list[index].toLocal8Bit().begin());
-                dwi_files.back()->image.resize(geo);
-                dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-                dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-            }
-            dicom_header2.save_to_buffer(
-                    dwi_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
-            ++b_index;
-            if(b_index >= b_num)
+            if(prog_aborted())
             {
-                b_index = 0;
-                ++slice_index;
+                failed = true;
+                return;
             }
+            check_prog(index,file_names.size());
         }
-    }
+        unsigned int b_index = iterate_slice_first ? index/slice_num : index%b_num;
+        unsigned int slice_index = iterate_slice_first ? index%slice_num : index/b_num;
+        if(slice_index >= geo[2] || (defer_image && slice_index))
+            return;
+        // the first file was loaded when probing the layout
+        image::io::dicom slice_file;
+        image::io::dicom& slice_header = index ? slice_file : dicom_header;
+        if(index && !slice_file.load_from_file(file_names[index].c_str()))
+        {
+            failed = true;
+            return;
+        }
+        DwiHeader& dwi = *new_files[b_index];
+        if(slice_index == 0)
+        {
+            // other threads are filling the volume, so the header is parsed into a separate DwiHeader
+            DwiHeader info;
+            info.open(slice_header);
+            dwi.file_name = file_names[index];
+            dwi.report = info.report;
+            dwi.te = info.te;
+            dwi.bvec = info.bvec;
+            dwi.bvalue = info.bvalue;
+        }
+        if(defer_image)
+            return;
+        slice_header.save_to_buffer(dwi.image.begin() + slice_index*geo.plane_size(),geo.plane_size());
+    },thread_count);
+    check_prog(file_names.size(),file_names.size());
+    if(failed)
+        return false;
+    dwi_files.insert(dwi_files.end(),new_files.begin(),new_files.end());
     return true;
 }
 bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
@@ -523,21 +552,48 @@ bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >&
     return true;
 }
 
-bool load_3d_series(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
+bool load_3d_series(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool defer_image,unsigned int thread_count)
 {
+    std::vector<std::string> file_names(file_list.size());
+    for (unsigned int index = 0;index < file_list.size();++index)
+        file_names[index] = file_list[index].toLocal8Bit().begin();
+    std::vector<std::shared_ptr<DwiHeader> > new_files(file_names.size());
+    std::atomic<bool> aborted(false);
     begin_prog("loading images");
-    for (unsigned int index = 0;check_prog(index,file_list.size());++index)
+    image::par_for2(file_names.size(),[&](int index,int thread_index)
     {
+        if(aborted)
+            return;
+        if(thread_index == 0)
+        {
+            if(prog_aborted())
+            {
+                aborted = true;
+                return;
+            }
+            check_prog(index,file_names.size());
+        }
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        if (!new_file->open(file_list[index].toLocal8Bit().begin()))
-            continue;
-        new_file->file_name = file_list[index].toLocal8Bit().begin();
-        dwi_files.push_back(new_file);
-    }
+        if (!new_file->open(file_names[index].c_str()))
+            return;
+        new_file->file_name = file_names[index];
+        if(defer_image)
+        {
+            new_file->source_files.push_back(file_names[index]);
+            new_file->source_geometry = new_file->image.geometry();
+            new_file->release_image();
+        }
+        new_files[index] = new_file;
+    },thread_count);
+    check_prog(file_names.size(),file_names.size());
+    for (unsigned int index = 0;index < new_files.size();++index)
+        if(new_files[index].get())
+            dwi_files.push_back(new_files[index]);
     return !dwi_files.empty();
 }
 
-bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
+// defer_image: DICOM slice and 3D series images are read again when they are written to the SRC file
+bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool defer_image,unsigned int thread_count)
 {
     if(QFileInfo(file_list[0]).fileName() == "2dseq")
     {
@@ -558,7 +614,7 @@ bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader>
             return false;
         for (unsigned int index = 0;index < dicom_file_list.size();++index)
             dicom_file_list[index] = file_list[0] + "/" + dicom_file_list[index];
-        return load_all_files(dicom_file_list,dwi_files);
+        return load_all_files(dicom_file_list,dwi_files,defer_image,thread_count);
     }
 
     //Combine 2dseq folders
@@ -566,7 +622,7 @@ bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader>
             QFileInfo(file_list[0]+"/pdata/1/2dseq").exists())
     {
         for(unsigned int index = 0;index < file_list.size();++index)
-            load_all_files(QStringList() << (file_list[index]+"/pdata/1/2dseq"),dwi_files);
+            load_all_files(QStringList() << (file_list[index]+"/pdata/1/2dseq"),dwi_files,defer_image,thread_count);
         return !dwi_files.empty();
     }
 
@@ -582,10 +638,10 @@ bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader>
     }
 
     std::sort(file_list.begin(),file_list.end(),compare_qstring());
-    if(load_multiple_slice_dicom(file_list,dwi_files))
+    if(load_multiple_slice_dicom(file_list,dwi_files,defer_image,thread_count))
         return !dwi_files.empty();
 
-    if(load_3d_series(file_list,dwi_files))
+    if(load_3d_series(file_list,dwi_files,defer_image,thread_count))
         return !dwi_files.empty();
 
     // multiple 4d nii
@@ -600,7 +656,7 @@ bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader>
 
 void dicom_parser::load_files(QStringList file_list)
 {
-    if(!load_all_files(file_list,dwi_files))
+    if(!load_all_files(file_list,dwi_files,false,std::thread::hardware_concurrency()))
     {
         QMessageBox::information(this,"Error","Invalid file format",0);
         close();
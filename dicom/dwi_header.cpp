@@ -1,5 +1,6 @@
 #include <sstream>
 #include <string>
+#include <atomic>
 #include "image/image.hpp"
 #include "dwi_header.hpp"
 #include "gzip_interface.hpp"
@@ -42,21 +43,22 @@ bool DwiHeader::open(const char* filename)
 {
     image::io::dicom header;
     if (header.load_from_file(filename))
-    {
-        header >> image;
-        header.get_voxel_size(voxel_size);
-        get_report_from_dicom(header,report);
-    }
-    else
-    {
-        image::io::nifti analyze_header;
-        if (!analyze_header.load_from_file(filename))
-            return false;
-        analyze_header >> image;
-        image::flip_xy(image);
-        analyze_header.get_voxel_size(voxel_size);
-        return true;
-    }
+        return open(header);
+    image::io::nifti analyze_header;
+    if (!analyze_header.load_from_file(filename))
+        return false;
+    analyze_header >> image;
+    image::flip_xy(image);
+    analyze_header.get_voxel_size(voxel_size);
+    return true;
+}
+
+// read the image and b-table from a loaded DICOM header
+bool DwiHeader::open(image::io::dicom& header)
+{
+    header >> image;
+    header.get_voxel_size(voxel_size);
+    get_report_from_dicom(header,report);
 
     unsigned char man_id = 0;
     {
@@ -195,6 +197,47 @@ bool DwiHeader::open(const char* filename)
     return true;
 }
 
+bool DwiHeader::load_image(void)
+{
+    if (!deferred() || !image.empty())
+        return true;
+    if (source_files.size() == 1)
+    {
+        DwiHeader source;
+        if (!source.open(source_files[0].c_str()) || source.image.size() != source_geometry.size())
+            return false;
+        image.swap(source.image);
+        return true;
+    }
+    // one DICOM file per slice, a missing slice is left zero
+    image.resize(source_geometry);
+    std::atomic<bool> failed(false);
+    image::par_for(source_files.size(),[&](int z)
+    {
+        if (source_files[z].empty() || failed)
+            return;
+        image::io::dicom header;
+        if (!header.load_from_file(source_files[z].c_str()))
+        {
+            failed = true;
+            return;
+        }
+        header.save_to_buffer(image.begin() + z*source_geometry.plane_size(),source_geometry.plane_size());
+    });
+    if (failed)
+    {
+        release_image();
+        return false;
+    }
+    return true;
+}
+
+void DwiHeader::release_image(void)
+{
+    if (deferred())
+        image::basic_image<unsigned short,3>().swap(image);
+}
+
 /*
 if (sort_and_merge)
 {
@@ -233,12 +276,31 @@ void sort_dwi(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
                 dwi_files[i].swap(dwi_files[j]);
 }
 
-void correct_t2(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
+// relative positions returned by image::get_neighbors for an interior voxel
+void get_neighbor_offsets(int radius,std::vector<image::vector<3,int> >& offsets)
 {
-    image::geometry<3> geo = dwi_files.front()->image.geometry();
+    image::geometry<3> geo(2*radius+1,2*radius+1,2*radius+1);
+    std::vector<image::pixel_index<3> > neighbors;
+    image::get_neighbors(image::pixel_index<3>(radius,radius,radius,geo),geo,radius,neighbors);
+    offsets.clear();
+    for (unsigned int index = 0;index < neighbors.size();++index)
+        offsets.push_back(image::vector<3,int>(neighbors[index].x()-radius,
+                                               neighbors[index].y()-radius,
+                                               neighbors[index].z()-radius));
+}
+
+// estimate -1/T2 and the spin density from b0 images of different TE. Only the b0 images are
+// read here, the DWIs are corrected by apply_t2_correction when they are written.
+bool correct_t2(std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
+                std::vector<double>& neg_inv_T2,std::vector<float>& spin_density_map)
+{
+    neg_inv_T2.clear();
+    spin_density_map.clear();
+    image::geometry<3> geo = dwi_files.front()->geometry();
     //find out if there are two b0 images having different TE
     std::vector<unsigned int> b0_index;
     std::vector<float> b0_te;
+    std::vector<const unsigned short*> b0_images;
     for (unsigned int index = 0;index < dwi_files.size();++index)
         if (dwi_files[index]->bvalue == 0.0)
         {
@@ -246,114 +308,102 @@ void correct_t2(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
             b0_te.push_back(dwi_files[index]->te);
         }
     if (b0_index.size() <= 1)
-        return;
-    // if multiple TE
+        return true;
+    for (unsigned int index = 0;index < b0_index.size();++index)
+    {
+        if (!dwi_files[b0_index[index]]->load_image())
+            return false;
+        b0_images.push_back(dwi_files[b0_index[index]]->begin());
+    }
+    // if multiple TE, then we can perform T2 correction
+    bool multiple_te = *std::max_element(b0_te.begin(),b0_te.end()) != *std::min_element(b0_te.begin(),b0_te.end());
     std::vector<double> spin_density(geo.size());
-    // average the b0 images
+    if (multiple_te)
+        neg_inv_T2.resize(geo.size());
+
+    // the samples of a voxel are its b0 signals and those of its neighbors,
+    // and also those within two voxels if there are not enough b0 images
+    std::vector<image::vector<3,int> > offsets1,offsets2;
+    if (multiple_te)
     {
-        for (unsigned int index = 0;index < b0_index.size();++index)
-            image::add(spin_density.begin(),spin_density.end(),dwi_files[b0_index[index]]->begin());
-        image::divide_constant(spin_density.begin(),spin_density.end(),b0_index.size());
+        get_neighbor_offsets(1,offsets1);
+        if (b0_te.size() < 4)
+            get_neighbor_offsets(2,offsets2);
     }
+    std::vector<const std::vector<image::vector<3,int> >*> offset_sets;
+    offset_sets.push_back(&offsets1);
+    if (!offsets2.empty())
+        offset_sets.push_back(&offsets2);
 
-    // if multiple TE, then we can perform T2 correction
-    if (*std::max_element(b0_te.begin(),b0_te.end()) != *std::min_element(b0_te.begin(),b0_te.end()))
+    const int w = geo.width(),h = geo.height(),d = geo.depth();
+    image::par_for(d,[&](int z)
     {
-        std::vector<double> neg_inv_T2(geo.size());//-1/T2
-        {
-            //begin_prog("Eliminating T2 effect");
-            for (image::pixel_index<3> index(geo);index < geo.size();++index)
+        for (int y = 0,index = z*geo.plane_size();y < h;++y)
+            for (int x = 0;x < w;++x,++index)
             {
-                std::vector<float> te_samples;
-                std::vector<float> log_Mxy_samples;
-                std::vector<image::pixel_index<3> > neighbor_index1,neighbor_index2;
-                image::get_neighbors(index,geo,1,neighbor_index1);
-                for (unsigned int i = 0;i < b0_te.size();++i)
+                // average the b0 images
                 {
-                    log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[index.index()]);
-                    te_samples.push_back(b0_te[i]);
-                    for (unsigned int j = 0;j < neighbor_index1.size();++j)
-                    {
-                        log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[neighbor_index1[j].index()]);
-                        te_samples.push_back(b0_te[i]);
-                    }
+                    double sum = 0.0;
+                    for (unsigned int i = 0;i < b0_images.size();++i)
+                        sum += b0_images[i][index];
+                    spin_density[index] = sum/b0_images.size();
                 }
-                // if not enough b0 images, take the neighbors!
-                if (b0_te.size() < 4)
+                if (!multiple_te)
+                    continue;
+                // log-linear regression of the nonzero samples: log(Mxy) = logM0 - TE/T2
+                double n = 0.0,sum_te = 0.0,sum_log = 0.0,sum_te2 = 0.0,sum_te_log = 0.0;
+                for (unsigned int k = 0;k < offset_sets.size();++k)
                 {
-                    image::get_neighbors(index,geo,2,neighbor_index2);
-                    for (unsigned int i = 0;i < b0_te.size();++i)
+                    const std::vector<image::vector<3,int> >& offsets = *offset_sets[k];
+                    for (unsigned int i = 0;i < b0_images.size();++i)
                     {
-                        log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[index.index()]);
-                        te_samples.push_back(b0_te[i]);
-
-                        for (unsigned int j = 0;j < neighbor_index2.size();++j)
+                        double te = b0_te[i];
+                        const unsigned short* b0 = b0_images[i];
+                        for (int j = -1;j < (int)offsets.size();++j)
                         {
-                            log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[neighbor_index2[j].index()]);
-                            te_samples.push_back(b0_te[i]);
+                            unsigned short value = 0;
+                            if (j < 0)
+                                value = b0[index];
+                            else
+                            {
+                                int nx = x+offsets[j][0],ny = y+offsets[j][1],nz = z+offsets[j][2];
+                                if (nx < 0 || ny < 0 || nz < 0 || nx >= w || ny >= h || nz >= d)
+                                    continue;
+                                value = b0[(nz*h+ny)*w+nx];
+                            }
+                            if (!value)
+                                continue;
+                            double log_value = std::log((double)value);
+                            n += 1.0;
+                            sum_te += te;
+                            sum_log += log_value;
+                            sum_te2 += te*te;
+                            sum_te_log += te*log_value;
                         }
                     }
                 }
-                for (unsigned int i = 0;i < log_Mxy_samples.size();)
-                {
-                    if (log_Mxy_samples[i])
-                    {
-                        log_Mxy_samples[i] = std::log(log_Mxy_samples[i]);
-                        ++i;
-                    }
-                    else
-                    {
-                        log_Mxy_samples[i] = log_Mxy_samples.back();
-                        te_samples[i] = te_samples.back();
-                        log_Mxy_samples.pop_back();
-                        te_samples.pop_back();
-                    }
-                }
-                if (log_Mxy_samples.empty())
+                double det = n*sum_te2-sum_te*sum_te;
+                if (n < 2.0 || det == 0.0)
                     continue;
                 // (-1/T2,logM0);
-                std::pair<double,double> T2_M0 = image::linear_regression(te_samples.begin(),te_samples.end(),log_Mxy_samples.begin());
+                double slope = (n*sum_te_log-sum_te*sum_log)/det;
+                double intercept = (sum_log-slope*sum_te)/n;
                 /*												T1			T2
                 Cerebrospinal fluid (similar to pure water) 	2200-2400 	500-1400
                 Gray matter of cerebrum 						920 		100
                 White matter of cerebrum 						780 		90
                 */
-                if (T2_M0.first < -1.0/2000.0)
+                if (slope < -1.0/2000.0)
                 {
-                    spin_density[index.index()] = std::exp(T2_M0.second);
-                    neg_inv_T2[index.index()] = T2_M0.first;
+                    spin_density[index] = std::exp(intercept);
+                    neg_inv_T2[index] = slope;
                 }
                 // If the T2 is too long, then exp(-TE/T2)~1, spin density is just the averaged b0 signal
-
             }
-        }
+    });
 
-
-        // perform correction for each image
-        for (unsigned int index = 0;index < dwi_files.size();++index)
-        {
-            // b0 will be handled later
-            if (dwi_files[index]->bvalue == 0.0)
-                continue;
-            DwiHeader& cur_image = *dwi_files[index];
-            float cur_te = dwi_files[index]->te;
-            for (unsigned int i = 0;i < geo.size();++i)
-                if (neg_inv_T2[i] != 0.0)
-                    cur_image[i] *= std::exp(-cur_te*neg_inv_T2[i]);
-        }
-
-        for (unsigned int index = 0;index < geo.size();++index)
-        {
-            if (neg_inv_T2[index] != 0.0)
-                neg_inv_T2[index] = -1.0/neg_inv_T2[index];
-            else
-                neg_inv_T2[index] = 2000;
-        }
-
-        //write_mat.write("spin_density",&*spin_density.begin(),1,total_size);
-        //write_mat.write("T2",&*neg_inv_T2.begin(),1,total_size);
-
-    }
+    spin_density_map.resize(geo.size());
+    std::copy(spin_density.begin(),spin_density.end(),spin_density_map.begin());
 
     // replace b0 with spin density map
     std::copy(spin_density.begin(),spin_density.end(),dwi_files[b0_index.front()]->begin());
@@ -365,6 +415,19 @@ void correct_t2(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
         else
             ++index;
     }
+    return true;
+}
+
+void apply_t2_correction(DwiHeader& dwi,const std::vector<double>& neg_inv_T2)
+{
+    image::geometry<3> geo = dwi.image.geometry();
+    float te = dwi.te;
+    image::par_for(geo.depth(),[&](int z)
+    {
+        for (unsigned int index = z*geo.plane_size(),end = index+geo.plane_size();index < end;++index)
+            if (neg_inv_T2[index] != 0.0)
+                dwi[index] *= std::exp(-te*neg_inv_T2[index]);
+    });
 }
 
 void calculate_shell(const std::vector<float>& bvalues,std::vector<unsigned int>& shell)
@@ -438,19 +501,12 @@ void get_report(const std::vector<float>& bvalues,image::vector<3> vs,std::strin
 
 
 
-// upsampling 1: upsampling 2: downsampling
-bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,int upsampling)
+// returns false if an image cannot be read or the user aborts
+bool write_src(gz_mat_write& write_mat,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
+               const std::vector<double>& neg_inv_T2,const std::vector<float>& spin_density,
+               int upsampling,bool output_t2)
 {
-    if(dwi_files.empty())
-        return false;
-    sort_dwi(dwi_files);
-    correct_t2(dwi_files);
-
-    gz_mat_write write_mat(di_file);
-    if(!write_mat)
-        return false;
-
-    image::geometry<3> geo = dwi_files.front()->image.geometry();
+    image::geometry<3> geo = dwi_files.front()->geometry();
 
     //store dimension
     unsigned int output_size = 0;
@@ -493,19 +549,30 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     if(!dwi_files[0]->mask.empty())
         write_mat.write("mask",&*dwi_files[0]->mask.begin(),1,dwi_files[0]->mask.size());
 
-    //store images
+    //store images, one volume at a time: a deferred image is read, corrected, resampled, written and released
     begin_prog("Save Files");
+    image::basic_image<unsigned short,3> buffer;
     for (unsigned int index = 0;check_prog(index,dwi_files.size());++index)
     {
+        DwiHeader& dwi = *dwi_files[index];
+        if(!dwi.load_image())
+            return false;
+        // the b0 image has been replaced by the spin density
+        if(!neg_inv_T2.empty() && dwi.bvalue != 0.0)
+            apply_t2_correction(dwi,neg_inv_T2);
         std::ostringstream name;
-        image::basic_image<unsigned short,3> buffer;
         const unsigned short* ptr = 0;
         name << "image" << index;
-        ptr = (const unsigned short*)dwi_files[index]->begin();
+        ptr = (const unsigned short*)dwi.begin();
         if(upsampling)
         {
-            buffer.resize(geo);
-            std::copy(ptr,ptr+geo.size(),buffer.begin());
+            if(dwi.deferred())
+                buffer.swap(dwi.image);
+            else
+            {
+                buffer.resize(geo);
+                std::copy(ptr,ptr+geo.size(),buffer.begin());
+            }
             if(upsampling == 1)
                 image::upsampling(buffer);
             if(upsampling == 2)
@@ -518,10 +585,22 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
             ptr = (const unsigned short*)&*buffer.begin();
         }
         write_mat.write(name.str().c_str(),ptr,1,output_size);
+        dwi.release_image();
+    }
+    if(prog_aborted())
+        return false;
+    if(output_t2 && !upsampling)
+    {
+        if(!spin_density.empty())
+            write_mat.write("spin_density",&*spin_density.begin(),1,spin_density.size());
+        if(!neg_inv_T2.empty())
+        {
+            std::vector<float> T2(neg_inv_T2.size());
+            for (unsigned int index = 0;index < T2.size();++index)
+                T2[index] = (neg_inv_T2[index] != 0.0) ? -1.0/neg_inv_T2[index] : 2000;
+            write_mat.write("T2",&*T2.begin(),1,T2.size());
+        }
     }
-
-
-
 
     std::string report1 = dwi_files.front()->report;
     std::string report2;
@@ -536,3 +615,36 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     write_mat.write("report",report1.c_str(),1,report1.length());
     return true;
 }
+
+// upsampling 1: upsampling 2: downsampling
+bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,int upsampling,bool output_t2)
+{
+    if(dwi_files.empty())
+        return false;
+    sort_dwi(dwi_files);
+    std::vector<double> neg_inv_T2;
+    std::vector<float> spin_density;
+    if(!correct_t2(dwi_files,neg_inv_T2,spin_density))
+        return false;
+    // deferred images are read while writing, so the SRC file only appears once all of them are written
+    std::string temp_file = gz_temp_file_name(di_file);
+    bool result = false;
+    {
+        gz_mat_write write_mat(temp_file.c_str());
+        if(!write_mat)
+            return false;
+        try{
+            result = write_src(write_mat,dwi_files,neg_inv_T2,spin_density,upsampling,output_t2);
+        }
+        catch(const std::exception&)
+        {
+            result = false;
+        }
+    }
+    if(!result)
+    {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return gz_replace_file(temp_file,di_file);
+}
@@ -22,6 +22,20 @@ public:
 public:
     DwiHeader(void): bvalue(0.0), te(0.0) {}
     bool open(const char* filename);
+    bool open(image::io::dicom& header);
+public:// deferred image: read from the source files when it is written, and released afterward
+    std::vector<std::string> source_files;// one 3D image file, or one DICOM file per slice
+    image::geometry<3> source_geometry;
+    bool deferred(void) const
+    {
+        return !source_files.empty();
+    }
+    image::geometry<3> geometry(void) const
+    {
+        return deferred() ? source_geometry : image.geometry();
+    }
+    bool load_image(void);
+    void release_image(void);
 public:
     const unsigned short* begin(void) const
     {
@@ -46,6 +60,8 @@ public:
 	void swap(DwiHeader& rhs)
 	{
         image.swap(rhs.image);
+        source_files.swap(rhs.source_files);
+        std::swap(source_geometry, rhs.source_geometry);
         std::swap(bvec, rhs.bvec);
         std::swap(bvalue, rhs.bvalue);
         std::swap(te, rhs.te);
@@ -89,7 +105,7 @@ public:
                bvalue == rhs.bvalue;
 	}
 public:
-    static bool output_src(const char* file_name, std::vector<std::shared_ptr<DwiHeader> >& dwi_files, int upsampling);
+    static bool output_src(const char* file_name, std::vector<std::shared_ptr<DwiHeader> >& dwi_files, int upsampling,bool output_t2 = false);
 };
 
 #endif//DWI_HEADER_HPP
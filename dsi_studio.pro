@@ -52,6 +52,9 @@ HEADERS += mainwindow.h \
     libs/dsi/dti_process.hpp \
     libs/dsi/dsi_process.hpp \
     libs/dsi/basic_voxel.hpp \
+    libs/dsi/block_product.hpp \
+    libs/dsi/gqi_kernel.hpp \
+    libs/dsi/sparse_odf_solver.hpp \
     libs/dsi_interface_static_link.h \
     SliceModel.h \
     tracking/tracking_window.h \
@@ -59,6 +62,7 @@ HEADERS += mainwindow.h \
     tracking/slice_view_scene.h \
     opengl/glwidget.h \
     libs/tracking/tracking_method.hpp \
+    libs/tracking/batch_tracking.hpp \
     libs/tracking/roi.hpp \
     libs/tracking/interpolation_process.hpp \
     libs/tracking/fib_data.hpp \
@@ -81,6 +85,7 @@ HEADERS += mainwindow.h \
     view_image.h \
     libs/vbc/vbc_database.h \
     libs/gzip_interface.hpp \
+    libs/mmap_mat.hpp \
     libs/dsi/racian_noise.hpp \
     libs/dsi/mix_gaussian_model.hpp \
     libs/dsi/layout.hpp \
@@ -120,6 +125,8 @@ SOURCES += main.cpp \
     dicom/dicom_parser.cpp \
     dicom/dwi_header.cpp \
     libs/utility/prog_interface.cpp \
+    libs/mmap_mat.cpp \
+    libs/gzip_interface.cpp \
     libs/dsi/sample_model.cpp \
     libs/dsi/dsi_interface_imp.cpp \
     libs/tracking/interpolation_process.cpp \
@@ -8,6 +8,7 @@
 #include "tessellated_icosahedron.hpp"
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
+#include "block_product.hpp"
 struct ImageModel;
 struct VoxelParam;
 class Voxel;
@@ -18,15 +19,40 @@ public:
     BaseProcess(void) {}
     virtual void init(Voxel&) {}
     virtual void run(Voxel&, VoxelData&) {}
+    // process a tile of voxels, overridden by processes that can batch their matrix products
+    virtual void run_block(Voxel& voxel, std::vector<VoxelData>& block,unsigned int size)
+    {
+        for(unsigned int index = 0;index < size;++index)
+            run(voxel,block[index]);
+    }
+    // combine the thread-private accumulators after all voxels are run
+    virtual void reduce(Voxel&) {}
     virtual void end(Voxel&,gz_mat_write&) {}
     virtual ~BaseProcess(void) {}
 };
 
 
 
+// accumulator kept for each thread, indexed by VoxelData::thread_index in run()
+// so that no lock is needed, and combined in thread order in reduce()
+template<class value_type>
+class thread_accumulator{
+    std::vector<value_type> data;
+public:
+    void init(unsigned int thread_count,const value_type& value = value_type())
+    {
+        data.clear();
+        data.resize(thread_count,value);
+    }
+    value_type& operator[](unsigned int thread_index){return data[thread_index];}
+    const value_type& operator[](unsigned int thread_index) const{return data[thread_index];}
+    unsigned int size(void) const{return data.size();}
+};
+
 struct VoxelData
 {
     unsigned int voxel_index;
+    unsigned int thread_index;
     std::vector<float> space;
     std::vector<float> odf;
     std::vector<float> fa;
@@ -71,6 +97,7 @@ public:// DTI
 public://used in GQI
     bool r2_weighted;// used in GQI only
     bool scheme_balance,csf_calibration;
+    float kernel_accuracy;// table-based kernel for per-voxel GQI/QSDR matrices, 0: exact
 public:// odf sharpening
     bool odf_deconvolusion;
     bool odf_decomposition;
@@ -105,8 +132,13 @@ public:// for template creation
     std::string template_file_name;
 public:
     std::vector<VoxelData> voxel_data;
+    std::vector<std::vector<VoxelData> > voxel_block;
+    unsigned int block_size; // voxels processed together by run_block, 1: one voxel at a time
+    unsigned int thread_count; // number of thread-private accumulators a process keeps
 public:
     ImageModel* image_model;
+public:
+    Voxel(void):kernel_accuracy(0.000001f),block_size(32),thread_count(1){}
 public:
     template<class ProcessList>
     void CreateProcesses(void)
@@ -121,16 +153,36 @@ public:
         process_list.push_back(std::make_shared<Process>());
     }
 public:
-    void init(unsigned int thread_count)
+    void init_data(VoxelData& data)
+    {
+        data.space.resize(bvalues.size());
+        data.odf.resize(ti.half_vertices_count);
+        data.fa.resize(max_fiber_number);
+        data.dir_index.resize(max_fiber_number);
+        data.dir.resize(max_fiber_number);
+    }
+    void init(unsigned int thread_count_)
     {
+        thread_count = std::max<unsigned int>(1,thread_count_);
         voxel_data.resize(thread_count);
         for (unsigned int index = 0; index < thread_count; ++index)
         {
-            voxel_data[index].space.resize(bvalues.size());
-            voxel_data[index].odf.resize(ti.half_vertices_count);
-            voxel_data[index].fa.resize(max_fiber_number);
-            voxel_data[index].dir_index.resize(max_fiber_number);
-            voxel_data[index].dir.resize(max_fiber_number);
+            init_data(voxel_data[index]);
+            voxel_data[index].thread_index = index;
+        }
+        voxel_block.clear();
+        if(block_size > 1)
+        {
+            voxel_block.resize(thread_count);
+            for (unsigned int index = 0; index < thread_count; ++index)
+            {
+                voxel_block[index].resize(block_size);
+                for (unsigned int i = 0; i < block_size; ++i)
+                {
+                    init_data(voxel_block[index][i]);
+                    voxel_block[index][i].thread_index = index;
+                }
+            }
         }
         for (unsigned int index = 0; index < process_list.size(); ++index)
             process_list[index]->init(*this);
@@ -148,25 +200,64 @@ public:
             if (mask[index])
                 ++total_voxel;
 
-        image::par_for2(mask.size(),
-                        [&](int voxel_index,int thread_index)
+        if(!voxel_block.empty())
         {
-            if(terminated || !mask[voxel_index])
-                return;
-            if(thread_index == 0)
+            std::vector<unsigned int> voxel_list;
+            voxel_list.reserve(total_voxel);
+            for(size_t index = 0;index < mask.size();++index)
+                if (mask[index])
+                    voxel_list.push_back(index);
+            image::par_for2((voxel_list.size()+block_size-1)/block_size,
+                            [&](int block_index,int thread_index)
             {
-                if(prog_aborted())
+                if(terminated)
+                    return;
+                size_t from = (size_t)block_index*block_size;
+                if(thread_index == 0)
                 {
-                    terminated = true;
+                    if(prog_aborted())
+                    {
+                        terminated = true;
+                        return;
+                    }
+                    check_prog(from,total_voxel);
+                }
+                unsigned int size = std::min<size_t>(block_size,voxel_list.size()-from);
+                std::vector<VoxelData>& block = voxel_block[thread_index];
+                for (unsigned int index = 0; index < size; ++index)
+                {
+                    block[index].init();
+                    block[index].voxel_index = voxel_list[from+index];
+                }
+                for (int index = 0; index < process_list.size(); ++index)
+                    process_list[index]->run_block(*this,block,size);
+            },thread_count);
+        }
+        else
+        {
+            image::par_for2(mask.size(),
+                            [&](int voxel_index,int thread_index)
+            {
+                if(terminated || !mask[voxel_index])
                     return;
+                if(thread_index == 0)
+                {
+                    if(prog_aborted())
+                    {
+                        terminated = true;
+                        return;
+                    }
+                    check_prog(voxel_index,total_voxel);
                 }
-                check_prog(voxel_index,total_voxel);
-            }
-            voxel_data[thread_index].init();
-            voxel_data[thread_index].voxel_index = voxel_index;
+                voxel_data[thread_index].init();
+                voxel_data[thread_index].voxel_index = voxel_index;
+                for (int index = 0; index < process_list.size(); ++index)
+                    process_list[index]->run(*this,voxel_data[thread_index]);
+            },thread_count);
+        }
+        if(!terminated)
             for (int index = 0; index < process_list.size(); ++index)
-                process_list[index]->run(*this,voxel_data[thread_index]);
-        },thread_count);
+                process_list[index]->reduce(*this);
         }
         catch(std::exception& error)
         {
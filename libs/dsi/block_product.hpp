@@ -0,0 +1,61 @@
+#ifndef BLOCK_PRODUCT_HPP
+#define BLOCK_PRODUCT_HPP
+#include <algorithm>
+#include <cstddef>
+
+/**
+  y[k] = M*x[k] for a tile of n voxels, M is a rows-by-cols row-major matrix.
+  M is streamed once per tile (in row blocks that stay in cache) instead of once per voxel,
+  and four voxels share each loaded matrix element.
+ */
+template<class matrix_type,class input_type,class output_type>
+void block_vector_product(const matrix_type* M,
+                          const input_type* const* x,
+                          output_type* const* y,
+                          unsigned int rows,unsigned int cols,unsigned int n)
+{
+    const unsigned int row_block = 32;
+    for(unsigned int r0 = 0;r0 < rows;r0 += row_block)
+    {
+        unsigned int r1 = std::min<unsigned int>(rows,r0+row_block);
+        unsigned int k = 0;
+        for(;k + 4 <= n;k += 4)
+        {
+            const input_type* x0 = x[k];
+            const input_type* x1 = x[k+1];
+            const input_type* x2 = x[k+2];
+            const input_type* x3 = x[k+3];
+            for(unsigned int r = r0;r < r1;++r)
+            {
+                const matrix_type* m = M + (size_t)r*cols;
+                output_type s0 = 0,s1 = 0,s2 = 0,s3 = 0;
+                for(unsigned int c = 0;c < cols;++c)
+                {
+                    output_type v = m[c];
+                    s0 += v*x0[c];
+                    s1 += v*x1[c];
+                    s2 += v*x2[c];
+                    s3 += v*x3[c];
+                }
+                y[k][r] = s0;
+                y[k+1][r] = s1;
+                y[k+2][r] = s2;
+                y[k+3][r] = s3;
+            }
+        }
+        for(;k < n;++k)
+        {
+            const input_type* x0 = x[k];
+            for(unsigned int r = r0;r < r1;++r)
+            {
+                const matrix_type* m = M + (size_t)r*cols;
+                output_type s0 = 0;
+                for(unsigned int c = 0;c < cols;++c)
+                    s0 += m[c]*x0[c];
+                y[k][r] = s0;
+            }
+        }
+    }
+}
+
+#endif//BLOCK_PRODUCT_HPP
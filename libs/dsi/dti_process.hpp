@@ -103,23 +103,53 @@ public:
         }
     }
 public:
-    virtual void run(Voxel& voxel, VoxelData& data)
+    void get_signal(const VoxelData& data,float* signal)
     {
-        std::vector<float> signal(data.space.size());
+        std::fill(signal,signal+data.space.size(),0.0f);
         if (data.space.front() != 0.0)
         {
             float logs0 = std::log(std::max<float>(1.0,data.space.front()));
             for (unsigned int i = 1; i < data.space.size(); ++i)
                 signal[i-1] = std::max<float>(0.0,logs0-std::log(std::max<float>(1.0,data.space[i])));
         }
+    }
+    virtual void run(Voxel& voxel, VoxelData& data)
+    {
+        std::vector<float> signal(data.space.size());
+        get_signal(data,&*signal.begin());
         //  Kt S = Kt K D
-        double KtS[6],tensor_param[6];
+        double KtS[6];
+        image::mat::product(Kt.begin(),signal.begin(),KtS,image::dyndim(6,b_count),image::dyndim(b_count,1));
+        fit(voxel,data,KtS);
+    }
+    virtual void run_block(Voxel& voxel, std::vector<VoxelData>& block,unsigned int size)
+    {
+        if(!size)
+            return;
+        unsigned int signal_size = block[0].space.size();
+        std::vector<float> signal(size*signal_size);
+        std::vector<double> KtS(size*6);
+        std::vector<const float*> signal_ptr(size);
+        std::vector<double*> KtS_ptr(size);
+        for (unsigned int i = 0; i < size; ++i)
+        {
+            signal_ptr[i] = &*signal.begin() + i*signal_size;
+            KtS_ptr[i] = &*KtS.begin() + i*6;
+            get_signal(block[i],&*signal.begin() + i*signal_size);
+        }
+        block_vector_product(&*Kt.begin(),&*signal_ptr.begin(),&*KtS_ptr.begin(),6,b_count,size);
+        for (unsigned int i = 0; i < size; ++i)
+            fit(voxel,block[i],KtS_ptr[i]);
+    }
+    void fit(Voxel& voxel, VoxelData& data,const double* KtS)
+    {
+        double b[6],tensor_param[6];
         double tensor[9];
         double V[9],d[3];
         for(unsigned int i = 0;i < iKtK.size();++i)
         {
-            image::mat::product(Kt.begin(),signal.begin(),KtS,image::dyndim(6,b_count),image::dyndim(b_count,1));
-            image::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,image::dyndim(6,6));
+            std::copy(KtS,KtS+6,b);
+            image::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),b,tensor_param,image::dyndim(6,6));
 
 
             unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
@@ -0,0 +1,119 @@
+#ifndef GQI_KERNEL_HPP
+#define GQI_KERNEL_HPP
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <boost/math/special_functions/sinc.hpp>
+
+/*
+ GQI kernel sinc(q·r) or its r²-weighted form, looked up from a table sampled
+ at a uniform interval and linearly interpolated. Both functions are even, so
+ the table covers [0,max|q|]. The interval starts from the interpolation bound
+ h²/8·max|f''| (f'' is bounded by 1/3 for sinc and 1/5 for the r²-weighted
+ function) and is halved until the table agrees with the exact function within
+ the requested accuracy at the sampled points of every interval.
+
+ odf(dir) = Σ kernel(q_i·dir)·space_i is accumulated directly, so the
+ odf-by-dwi matrix of a voxel is never built. An argument outside the table
+ (e.g. a direction from a degenerate jacobian) is computed exactly.
+*/
+class gqi_kernel{
+    std::vector<float> value,slope;
+    double inv_interval;
+    double max_t;// last table index
+    bool r2_weighted;
+    std::vector<double> qx,qy,qz;
+public:
+    static double r2_base_function(double theta)
+    {
+        if(std::abs(theta) < 0.000001)
+            return 1.0/3.0;
+        return (2*std::cos(theta)+(theta-2.0/theta)*std::sin(theta))/theta/theta;
+    }
+    static double exact(bool r2_weighted,double theta)
+    {
+        return r2_weighted ? r2_base_function(theta) : boost::math::sinc_pi(theta);
+    }
+public:
+    gqi_kernel(void):inv_interval(0.0),max_t(0.0),r2_weighted(false){}
+    bool empty(void) const{return value.empty();}
+    // returns false and leaves the kernel empty if the table cannot reach the accuracy
+    template<class vector_type>
+    bool init(const std::vector<vector_type>& q_vectors,bool r2_weighted_,double accuracy)
+    {
+        r2_weighted = r2_weighted_;
+        qx.resize(q_vectors.size());
+        qy.resize(q_vectors.size());
+        qz.resize(q_vectors.size());
+        double max_theta = 0.0;
+        for(unsigned int i = 0;i < q_vectors.size();++i)
+        {
+            qx[i] = q_vectors[i][0];
+            qy[i] = q_vectors[i][1];
+            qz[i] = q_vectors[i][2];
+            max_theta = std::max(max_theta,std::sqrt(qx[i]*qx[i]+qy[i]*qy[i]+qz[i]*qz[i]));
+        }
+        double interval = std::sqrt(8.0*accuracy/(r2_weighted ? 0.2 : 1.0/3.0));
+        // the table is capped at 4M entries
+        for(;std::ceil(max_theta/interval)+2 <= double(1 << 22);interval *= 0.5)
+        {
+            unsigned int size = std::ceil(max_theta/interval)+2;
+            inv_interval = 1.0/interval;
+            max_t = size-1;
+            value.resize(size);
+            slope.resize(size);
+            for(unsigned int k = 0;k < size;++k)
+                value[k] = exact(r2_weighted,interval*k);
+            for(unsigned int k = 0;k+1 < size;++k)
+                slope[k] = value[k+1]-value[k];
+            slope.back() = 0.0f;
+            double max_error = 0.0;
+            for(unsigned int k = 0;k+1 < size;++k)
+                for(double f = 0.25;f < 1.0;f += 0.25)
+                {
+                    double theta = interval*(k+f);
+                    max_error = std::max(max_error,std::abs((*this)(theta)-exact(r2_weighted,theta)));
+                }
+            if(max_error <= accuracy)
+                return true;
+        }
+        value.clear();
+        slope.clear();
+        return false;
+    }
+    float operator()(double theta) const
+    {
+        double t = std::abs(theta)*inv_interval;
+        if(!(t < max_t)) // also catches NaN
+            return exact(r2_weighted,theta);
+        unsigned int k = t;
+        return value[k]+float(t-k)*slope[k];
+    }
+    // Σ kernel(q_i·dir)·space_i
+    template<class dir_type>
+    float dot(const dir_type& dir,const float* space) const
+    {
+        const double dx = dir[0],dy = dir[1],dz = dir[2];
+        const double* x = qx.data();
+        const double* y = qy.data();
+        const double* z = qz.data();
+        const float* v = &value[0];
+        const float* s = &slope[0];
+        float sum = 0.0f;
+        for(unsigned int i = 0,n = qx.size();i < n;++i)
+        {
+            double theta = x[i]*dx+y[i]*dy+z[i]*dz;
+            double t = std::abs(theta)*inv_interval;
+            if(!(t < max_t))
+            {
+                sum += exact(r2_weighted,theta)*space[i];
+                continue;
+            }
+            unsigned int k = t;
+            sum += (v[k]+float(t-k)*s[k])*space[i];
+        }
+        return sum;
+    }
+};
+
+#endif//GQI_KERNEL_HPP
@@ -444,15 +444,9 @@ public:
 
 class QSDR  : public BaseProcess
 {
-public:
-    double r2_base_function(double theta)
-    {
-        if(std::abs(theta) < 0.000001)
-            return 1.0/3.0;
-        return (2*std::cos(theta)+(theta-2.0/theta)*std::sin(theta))/theta/theta;
-    }
 protected:
     std::vector<image::vector<3,double> > q_vectors_time;
+    gqi_kernel kernel;
 public:
     virtual void init(Voxel& voxel)
     {
@@ -464,22 +458,32 @@ public:
             q_vectors_time[index] *= std::sqrt(voxel.bvalues[index]*0.01506);// get q in (mm) -1
             q_vectors_time[index] *= sigma;
         }
+        if(voxel.kernel_accuracy > 0.0 && !kernel.init(q_vectors_time,voxel.r2_weighted,voxel.kernel_accuracy))
+            std::cout << "the GQI kernel table cannot reach an accuracy of " << voxel.kernel_accuracy << ", the exact kernel is used" << std::endl;
     }
 
     virtual void run(Voxel& voxel, VoxelData& data)
     {
+        if(!kernel.empty())
+        {
+            for (unsigned int j = 0; j < data.odf.size(); ++j)
+            {
+                image::vector<3,double> from(voxel.ti.vertices[j]);
+                from.rotate(data.jacobian);
+                from.normalize();
+                data.odf[j] = kernel.dot(from,&*data.space.begin());
+            }
+            image::multiply_constant(data.odf,data.jdet);
+            return;
+        }
         std::vector<float> sinc_ql(data.odf.size()*data.space.size());
         for (unsigned int j = 0,index = 0; j < data.odf.size(); ++j)
         {
             image::vector<3,double> from(voxel.ti.vertices[j]);
             from.rotate(data.jacobian);
             from.normalize();
-            if(voxel.r2_weighted)
-                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                    sinc_ql[index] = r2_base_function(q_vectors_time[i]*from);
-            else
-                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                    sinc_ql[index] = boost::math::sinc_pi(q_vectors_time[i]*from);
+            for (unsigned int i = 0; i < data.space.size(); ++i,++index)
+                sinc_ql[index] = gqi_kernel::exact(voxel.r2_weighted,q_vectors_time[i]*from);
 
         }
         image::mat::vector_product(&*sinc_ql.begin(),&*data.space.begin(),&*data.odf.begin(),
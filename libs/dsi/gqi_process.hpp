@@ -6,6 +6,7 @@
 #include "basic_process.hpp"
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
+#include "gqi_kernel.hpp"
 
 
 class QSpace2Odf  : public BaseProcess
@@ -15,12 +16,7 @@ public:// recorded for scheme balanced
 public:
     std::vector<unsigned int> b0_images;
     std::vector<float> sinc_ql;
-    double base_function(double theta)
-    {
-        if(std::abs(theta) < 0.000001)
-            return 1.0/3.0;
-        return (2*std::cos(theta)+(theta-2.0/theta)*std::sin(theta))/theta/theta;
-    }
+    gqi_kernel kernel;
 public:
     virtual void init(Voxel& voxel)
     {
@@ -43,6 +39,8 @@ public:
                 q_vectors_time[index] *= std::sqrt(voxel.bvalues[index]*0.01506);// get q in (mm) -1
                 q_vectors_time[index] *= sigma;
             }
+            if(voxel.kernel_accuracy > 0.0 && !kernel.init(q_vectors_time,voxel.r2_weighted,voxel.kernel_accuracy))
+                std::cout << "the GQI kernel table cannot reach an accuracy of " << voxel.kernel_accuracy << ", the exact kernel is used" << std::endl;
             return;
         }
         sinc_ql.resize(odf_size*voxel.bvalues.size());
@@ -54,9 +52,7 @@ public:
                                std::sqrt(voxel.bvalues[i]*0.01506);
 
         for (unsigned int index = 0; index < sinc_ql.size(); ++index)
-            sinc_ql[index] = voxel.r2_weighted ?
-                         base_function(sinc_ql[index]*sigma):
-                         boost::math::sinc_pi(sinc_ql[index]*sigma);
+            sinc_ql[index] = gqi_kernel::exact(voxel.r2_weighted,sinc_ql[index]*sigma);
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
@@ -71,18 +67,25 @@ public:
             for(unsigned int i = 0; i < 9; ++i)
                 grad_dev[i] = voxel.grad_dev[i][data.voxel_index];
             image::mat::transpose(grad_dev,image::dim<3,3>());
+            if(!kernel.empty())
+            {
+                for (unsigned int j = 0; j < data.odf.size(); ++j)
+                {
+                    image::vector<3,float> from(voxel.ti.vertices[j]);
+                    from.rotate(grad_dev);
+                    from.normalize();
+                    data.odf[j] = kernel.dot(from,&*data.space.begin());
+                }
+                return;
+            }
             std::vector<float> new_sinc_ql(data.odf.size()*data.space.size());
             for (unsigned int j = 0,index = 0; j < data.odf.size(); ++j)
             {
                 image::vector<3,float> from(voxel.ti.vertices[j]);
                 from.rotate(grad_dev);
                 from.normalize();
-                if(voxel.r2_weighted)
-                    for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                        new_sinc_ql[index] = base_function(q_vectors_time[i]*from);
-                else
-                    for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                        new_sinc_ql[index] = boost::math::sinc_pi(q_vectors_time[i]*from);
+                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
+                    new_sinc_ql[index] = gqi_kernel::exact(voxel.r2_weighted,q_vectors_time[i]*from);
 
             }
             image::mat::vector_product(&*new_sinc_ql.begin(),&*data.space.begin(),&*data.odf.begin(),
@@ -92,6 +95,25 @@ public:
             image::mat::vector_product(&*sinc_ql.begin(),&*data.space.begin(),&*data.odf.begin(),
                                     image::dyndim(data.odf.size(),data.space.size()));
     }
+    virtual void run_block(Voxel& voxel, std::vector<VoxelData>& block,unsigned int size)
+    {
+        if(!voxel.grad_dev.empty() || !size) // sinc_ql differs for each voxel
+        {
+            BaseProcess::run_block(voxel,block,size);
+            return;
+        }
+        std::vector<const float*> space(size);
+        std::vector<float*> odf(size);
+        for(unsigned int index = 0;index < size;++index)
+        {
+            if(b0_images.size() == 1 && voxel.half_sphere)
+                block[index].space[b0_images.front()] /= 2.0;
+            space[index] = &*block[index].space.begin();
+            odf[index] = &*block[index].odf.begin();
+        }
+        block_vector_product(&*sinc_ql.begin(),&*space.begin(),&*odf.begin(),
+                             block[0].odf.size(),block[0].space.size(),size);
+    }
 
 };
 
@@ -286,13 +308,6 @@ public:
     std::vector<unsigned int> b0_images;
     std::vector<std::vector<float> > cdf,dis,cdfw,disw;
 
-
-    double base_function(double theta)
-    {
-        if(std::abs(theta) < 0.000001)
-            return 1.0/3.0;
-        return (2*std::cos(theta)+(theta-2.0/theta)*std::sin(theta))/theta/theta;
-    }
 public:
     virtual void init(Voxel& voxel)
     {
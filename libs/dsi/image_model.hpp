@@ -2,18 +2,96 @@
 #define IMAGE_MODEL_HPP
 #include "gqi_process.hpp"
 #include "image/image.hpp"
+#include <boost/mpl/contains.hpp>
 
+class ReadDWIData;
 void get_report(const std::vector<float>& bvalues,image::vector<3> vs,std::string& report);
 struct ImageModel
 {
 private:
     std::vector<image::basic_image<unsigned short,3> > new_dwi;//used in rotated volume
+private:// q-space-contiguous DWI: all samples of a masked voxel are stored next to each other
+    std::vector<unsigned short> voxel_dwi;
+    std::vector<unsigned int> voxel_dwi_index;
+    image::basic_image<unsigned char,3> voxel_dwi_mask;
+    unsigned int voxel_dwi_count;
 public:
     Voxel voxel;
     std::string file_name,error_msg;
     gz_mat_read mat_reader;
     std::vector<const unsigned short*> dwi_data;
     image::basic_image<unsigned char,3> mask;
+    bool interleave_dwi;
+public:
+    ImageModel(void):voxel_dwi_count(0),interleave_dwi(true){}
+public:
+    // build the q-space-contiguous buffer for the current mask, reuse it if nothing changed
+    void calculate_voxel_dwi(void)
+    {
+        if(!interleave_dwi || dwi_data.empty())
+        {
+            clear_voxel_dwi();
+            return;
+        }
+        if(!voxel_dwi.empty() &&
+           voxel_dwi_count == dwi_data.size() &&
+           voxel_dwi_mask.geometry() == mask.geometry() &&
+           std::equal(mask.begin(),mask.end(),voxel_dwi_mask.begin()))
+            return;
+        clear_voxel_dwi();
+        std::vector<unsigned int> masked_voxel;
+        std::vector<unsigned int> index_map(mask.size());
+        for(unsigned int index = 0;index < mask.size();++index)
+            if(mask[index])
+            {
+                index_map[index] = masked_voxel.size();
+                masked_voxel.push_back(index);
+            }
+        if(masked_voxel.empty())
+            return;
+        size_t dwi_count = dwi_data.size();
+        try
+        {
+            voxel_dwi.resize(masked_voxel.size()*dwi_count);
+        }
+        catch(...)
+        {
+            // not enough memory: ReadDWIData falls back to the per-volume pointers
+            clear_voxel_dwi();
+            return;
+        }
+        // blocked transpose: each block reads short runs of every volume and writes one contiguous chunk
+        const size_t block_size = 2048;
+        image::par_for((masked_voxel.size()+block_size-1)/block_size,[&](int block)
+        {
+            size_t from = block*block_size;
+            size_t to = std::min<size_t>(from+block_size,masked_voxel.size());
+            for(size_t i = 0;i < dwi_count;++i)
+            {
+                const unsigned short* dwi = dwi_data[i];
+                unsigned short* out = &voxel_dwi[0] + from*dwi_count + i;
+                for(size_t j = from;j < to;++j,out += dwi_count)
+                    *out = dwi[masked_voxel[j]];
+            }
+        });
+        voxel_dwi_index.swap(index_map);
+        voxel_dwi_mask = mask;
+        voxel_dwi_count = dwi_count;
+    }
+    void clear_voxel_dwi(void)
+    {
+        std::vector<unsigned short>().swap(voxel_dwi);
+        std::vector<unsigned int>().swap(voxel_dwi_index);
+        voxel_dwi_mask.clear();
+        voxel_dwi_count = 0;
+    }
+    // return 0 if the voxel is not in the q-space-contiguous buffer
+    const unsigned short* get_voxel_dwi(unsigned int voxel_index) const
+    {
+        if(voxel_dwi.empty() || voxel_index >= voxel_dwi_index.size() || !voxel_dwi_mask[voxel_index])
+            return 0;
+        return &voxel_dwi[0] + (size_t)voxel_dwi_index[voxel_index]*voxel_dwi_count;
+    }
 public:
     void flip_b_table(unsigned char dim)
     {
@@ -66,6 +144,7 @@ public:
             rotate_b_table(type-3);
 
         }
+        clear_voxel_dwi();
         image::flip(voxel.dwi_sum,type);
         image::flip(mask,type);
         for(unsigned int i = 0;i < voxel.grad_dev.size();++i)
@@ -83,6 +162,7 @@ public:
     // used in eddy correction for each dwi
     void rotate_dwi(unsigned int dwi_index,const image::transformation_matrix<double>& affine)
     {
+        clear_voxel_dwi();
         image::basic_image<float,3> tmp(voxel.dim);
         auto I = image::make_image((unsigned short*)dwi_data[dwi_index],voxel.dim);
         image::resample(I,tmp,affine,image::cubic);
@@ -99,6 +179,7 @@ public:
 
     void rotate(image::geometry<3> new_geo,const image::transformation_matrix<double>& affine)
     {
+        clear_voxel_dwi();
         std::vector<image::basic_image<unsigned short,3> > dwi(dwi_data.size());
         for (unsigned int index = 0;check_prog(index,dwi_data.size());++index)
         {
@@ -152,6 +233,7 @@ public:
     }
     void trim(void)
     {
+        clear_voxel_dwi();
         image::geometry<3> range_min,range_max;
         image::bounding_box(mask,range_min,range_max,0);
         for (unsigned int index = 0;check_prog(index,dwi_data.size());++index)
@@ -227,6 +309,8 @@ public:
 public:
     bool load_from_file(const char* dwi_file_name)
     {
+        // the buffer of a previously loaded file points to its volumes
+        clear_voxel_dwi();
         file_name = dwi_file_name;
         if (!mat_reader.load_from_file(dwi_file_name))
         {
@@ -409,6 +493,8 @@ public:
         voxel.image_model = this;
         voxel.CreateProcesses<ProcessType>();
         voxel.init(thread_count);
+        if(boost::mpl::contains<ProcessType,ReadDWIData>::type::value)
+            calculate_voxel_dwi();
         voxel.run(thread_count,mask);
         return !prog_aborted();
     }
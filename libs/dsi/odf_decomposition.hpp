@@ -7,6 +7,7 @@
 #include "image/image.hpp"
 #include "basic_process.hpp"
 #include "basic_voxel.hpp"
+#include "sparse_odf_solver.hpp"
 
 struct ODFDecomposition : public BaseProcess
 {
@@ -14,9 +15,11 @@ struct ODFDecomposition : public BaseProcess
     float decomposition_fraction;
 protected:
     std::vector<float> fiber_ratio;
-    float max_iso;
+    thread_accumulator<float> max_iso;
 protected:
     std::vector<float> Rt,oRt;
+    sparse_odf_solver solver;
+    thread_accumulator<sparse_odf_solver::workspace> workspace;
     unsigned int half_odf_size;
     unsigned char m;
 
@@ -81,137 +84,16 @@ protected:
 
         }
     }
-    /*
-     * the step is assigned to make the correlation c(y,xi) and c(y,xj) equal
-     * xi(y-step*u) = xj(y-step*u)
-     * xi*y-xj*y = step(xi*u-xj*u);
-     */
-    template<class iterator1,class iterator2,class iterator3>
-    float lar_get_step(iterator1 u,iterator2 xi,iterator2 xj,iterator3 y,unsigned int y_dim)
+    // fit by the pseudo inverse, used when the active set is rank deficient
+    void fit_dense(const std::vector<float>& old_odf,sparse_odf_solver::workspace& ws)
     {
-        float t1 = 0,t2 = 0;
-        for(int i = 0;i < y_dim;++i)
-        {
-            float dif = (xi[i]-xj[i]);
-            t1 += dif*y[i];
-            t2 += dif*u[i];
-        }
-        if(t2 + 1.0 == 1.0)
-            return 0.0;
-        return t1/t2;
-    }
-
-    void lasso2(const std::vector<float>& y,const std::vector<float>& x,std::vector<float>& w,unsigned int max_fiber)
-    {
-        unsigned int y_dim = y.size();
-        std::vector<float> residual(y);
-        std::vector<float> tmp(y_dim);
-        std::vector<char> fib_map(y_dim);
-        w.resize(y_dim);
-
-        float step_size = decomposition_fraction;
-        unsigned int max_iter = ((float)max_fiber/step_size);
-        unsigned char total_fiber = 0;
-        for(int fib_index = 0;fib_index < max_iter;++fib_index)
-        {
-            // calculate the correlation with each SFO
-
-            image::mat::vector_product(&*x.begin(),&*residual.begin(),&*tmp.begin(),
-                                            image::dyndim(y_dim,y_dim));
-            // get the most correlated orientation
-            int dir = std::max_element(tmp.begin(),tmp.end())-tmp.begin();
-            float corr = tmp[dir];
-            if(corr < 0.0)
-                break;
-            if(!fib_map[dir])
-            {
-                total_fiber++;
-                if(total_fiber > max_fiber)
-                    break;
-                fib_map[dir] = 1;
-            }
-            std::vector<float>::const_iterator xi = x.begin()+dir*y_dim;
-            if(fib_index == 0)
-            {
-                std::vector<float>::const_iterator xj = x.begin();
-                float min_step_value = std::numeric_limits<float>::max();
-                int min_step_dir = 0;
-                for(int index = 0;index < y_dim;++index,xj += y_dim)
-                {
-                    if(index == dir)
-                        continue;
-                    float value = lar_get_step(xi,xi,xj,residual.begin(),y_dim);
-                    if(value < min_step_value)
-                    {
-                        min_step_dir = index;
-                        min_step_value = value;
-                    }
-                }
-                w[dir] += min_step_value;
-                image::vec::axpy(residual.begin(),residual.end(),-min_step_value,xi);
-            }
-            else
-            {
-                w[dir] += corr*step_size;
-                image::vec::axpy(residual.begin(),residual.end(),-corr*step_size,xi);
-            }
-        }
-    }
-
-public:
-    virtual void init(Voxel& voxel)
-    {
-        if (!voxel.odf_decomposition)
-            return;
-        voxel.recon_report << "Diffusion ODF decomposition (Yeh et al., PLoS ONE 8(10): e75747, 2013) was conducted using a decomposition fraction of " << voxel.param[3];
-        decomposition_fraction = voxel.param[3];
-        m = std::max<int>(voxel.param[4],voxel.max_fiber_number);
-        fiber_ratio.resize(voxel.dim.size());
-        max_iso = 0.0;
-        half_odf_size = voxel.ti.half_vertices_count;
-        is_neighbor.resize(half_odf_size);
+        std::vector<int>& dir_list = ws.dir_list;
+        std::vector<float>& results = ws.results;
+        dir_list.clear();
         for(unsigned int index = 0;index < half_odf_size;++index)
-            is_neighbor[index].resize(half_odf_size);
-        for(unsigned int index = 0;index < voxel.ti.faces.size();++index)
-        {
-            short i1 = voxel.ti.faces[index][0];
-            short i2 = voxel.ti.faces[index][1];
-            short i3 = voxel.ti.faces[index][2];
-            if (i1 >= half_odf_size)
-                i1 -= half_odf_size;
-            if (i2 >= half_odf_size)
-                i2 -= half_odf_size;
-            if (i3 >= half_odf_size)
-                i3 -= half_odf_size;
-            is_neighbor[i1][i2] = 1;
-            is_neighbor[i2][i1] = 1;
-            is_neighbor[i1][i3] = 1;
-            is_neighbor[i3][i1] = 1;
-            is_neighbor[i2][i3] = 1;
-            is_neighbor[i3][i2] = 1;
-        }
-        // scale the free water diffusion to 1
-        image::divide_constant(voxel.free_water_diffusion,voxel.reponse_function_scaling);
-        estimate_Rt(voxel);
-
-    }
-    virtual void run(Voxel& voxel, VoxelData& data)
-    {
-
-        if (!voxel.odf_decomposition)
-            return;
-        std::vector<float> old_odf(data.odf);
-        normalize_vector(data.odf.begin(),data.odf.end());
-        std::vector<float> w;
-        lasso2(data.odf,Rt,w,m);
-
-        std::vector<int> dir_list;
-
-        for(unsigned int index = 0;index < half_odf_size;++index)
-            if(w[index] > 0.0)
+            if(ws.w[index] > 0.0)
                 dir_list.push_back(index);
 
-        std::vector<float> results;
         int has_isotropic = 1;
         while(1)
         {
@@ -275,6 +157,63 @@ public:
             dir_list.erase(dir_list.begin()+smallest_neighbor);
             results.erase(results.begin()+smallest_neighbor+has_isotropic);
         }
+        ws.has_isotropic = has_isotropic;
+    }
+
+public:
+    virtual void init(Voxel& voxel)
+    {
+        if (!voxel.odf_decomposition)
+            return;
+        voxel.recon_report << "Diffusion ODF decomposition (Yeh et al., PLoS ONE 8(10): e75747, 2013) was conducted using a decomposition fraction of " << voxel.param[3];
+        decomposition_fraction = voxel.param[3];
+        m = std::max<int>(voxel.param[4],voxel.max_fiber_number);
+        fiber_ratio.resize(voxel.dim.size());
+        max_iso.init(voxel.thread_count,0.0f);
+        half_odf_size = voxel.ti.half_vertices_count;
+        is_neighbor.resize(half_odf_size);
+        for(unsigned int index = 0;index < half_odf_size;++index)
+            is_neighbor[index].resize(half_odf_size);
+        for(unsigned int index = 0;index < voxel.ti.faces.size();++index)
+        {
+            short i1 = voxel.ti.faces[index][0];
+            short i2 = voxel.ti.faces[index][1];
+            short i3 = voxel.ti.faces[index][2];
+            if (i1 >= half_odf_size)
+                i1 -= half_odf_size;
+            if (i2 >= half_odf_size)
+                i2 -= half_odf_size;
+            if (i3 >= half_odf_size)
+                i3 -= half_odf_size;
+            is_neighbor[i1][i2] = 1;
+            is_neighbor[i2][i1] = 1;
+            is_neighbor[i1][i3] = 1;
+            is_neighbor[i3][i1] = 1;
+            is_neighbor[i2][i3] = 1;
+            is_neighbor[i3][i2] = 1;
+        }
+        // scale the free water diffusion to 1
+        image::divide_constant(voxel.free_water_diffusion,voxel.reponse_function_scaling);
+        estimate_Rt(voxel);
+        solver.init(Rt,oRt,half_odf_size,m,is_neighbor);
+        workspace.init(voxel.thread_count);
+        for(unsigned int index = 0;index < workspace.size();++index)
+            solver.init(workspace[index]);
+    }
+    virtual void run(Voxel& voxel, VoxelData& data)
+    {
+
+        if (!voxel.odf_decomposition)
+            return;
+        sparse_odf_solver::workspace& ws = workspace[data.thread_index];
+        ws.y = data.odf;
+        normalize_vector(ws.y.begin(),ws.y.end());
+        solver.lasso(ws,decomposition_fraction,m);
+        if(!solver.fit(ws,&data.odf[0]))
+            fit_dense(data.odf,ws);
+        const std::vector<int>& dir_list = ws.dir_list;
+        const std::vector<float>& results = ws.results;
+        int has_isotropic = ws.has_isotropic;
         float fiber_sum = std::accumulate(results.begin()+has_isotropic,results.end(),0.0f);
 
         data.min_odf = has_isotropic ? std::max<float>(results[0],0.0):0.0;
@@ -282,16 +221,19 @@ public:
         for(int index = 0;index < dir_list.size();++index)
             data.odf[dir_list[index]] += results[index+has_isotropic];
 
-        if(data.min_odf > max_iso)
-            max_iso = data.min_odf;
+        if(data.min_odf > max_iso[data.thread_index])
+            max_iso[data.thread_index] = data.min_odf;
         fiber_ratio[data.voxel_index] = fiber_sum;
     }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
         if (!voxel.odf_decomposition)
             return;
-        if(max_iso + 1.0 != 1.0)
-            image::divide_constant(fiber_ratio,max_iso);
+        float max_iso_value = 0.0;
+        for(unsigned int index = 0;index < max_iso.size();++index)
+            max_iso_value = std::max(max_iso_value,max_iso[index]);
+        if(max_iso_value + 1.0 != 1.0)
+            image::divide_constant(fiber_ratio,max_iso_value);
         mat_writer.write("fiber_ratio",&*fiber_ratio.begin(),1,fiber_ratio.size());
 
     }
@@ -7,8 +7,23 @@
 
 struct EstimateResponseFunction : public BaseProcess
 {
-    float max_value;
-    std::mutex  mutex;
+    struct odf_candidate{
+        float value;
+        unsigned int voxel_index;
+        std::vector<float> odf;
+        odf_candidate(void):value(0.0f),voxel_index(0){}
+    };
+    // the largest mean odf: ties go to the lowest voxel index
+    static bool better_scaling(float value,unsigned int voxel_index,const odf_candidate& rhs)
+    {
+        return value > rhs.value || (!rhs.odf.empty() && value == rhs.value && voxel_index < rhs.voxel_index);
+    }
+    // the largest fa0-fa1-fa2: ties go to the highest voxel index
+    static bool better_response(float value,unsigned int voxel_index,const odf_candidate& rhs)
+    {
+        return value > rhs.value || (value == rhs.value && (rhs.odf.empty() || voxel_index > rhs.voxel_index));
+    }
+    thread_accumulator<odf_candidate> scaling,response;
     bool has_assigned_odf;
     unsigned int assigned_index;
 public:
@@ -27,27 +42,51 @@ public:
             has_assigned_odf = false;
         voxel.response_function.resize(voxel.ti.half_vertices_count);
         voxel.reponse_function_scaling = 0;
-        max_value = 0;
         std::fill(voxel.response_function.begin(),voxel.response_function.end(),1.0);
+        scaling.init(voxel.thread_count);
+        response.init(voxel.thread_count);
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-
         float max_diffusion_value = std::accumulate(data.odf.begin(),data.odf.end(),0.0)/data.odf.size();
-        if (max_diffusion_value > voxel.reponse_function_scaling)
-		{
-			voxel.reponse_function_scaling = max_diffusion_value;
-			voxel.free_water_diffusion = data.odf;
+        odf_candidate& s = scaling[data.thread_index];
+        if (better_scaling(max_diffusion_value,data.voxel_index,s))
+        {
+            s.value = max_diffusion_value;
+            s.voxel_index = data.voxel_index;
+            s.odf = data.odf;
         }
 
         if(has_assigned_odf && data.voxel_index != assigned_index)
             return;
         float cur_value = data.fa[0]-data.fa[1]-data.fa[2];
-        if (cur_value < max_value)
+        odf_candidate& r = response[data.thread_index];
+        if (!better_response(cur_value,data.voxel_index,r))
             return;
-        voxel.response_function = data.odf;
-        max_value = cur_value;
+        r.value = cur_value;
+        r.voxel_index = data.voxel_index;
+        r.odf = data.odf;
+    }
+    virtual void reduce(Voxel& voxel)
+    {
+        // the same voxels are chosen as in a single-threaded pass
+        unsigned int s = 0,r = 0;
+        for(unsigned int index = 1;index < voxel.thread_count;++index)
+        {
+            if(!scaling[index].odf.empty() &&
+               better_scaling(scaling[index].value,scaling[index].voxel_index,scaling[s]))
+                s = index;
+            if(!response[index].odf.empty() &&
+               better_response(response[index].value,response[index].voxel_index,response[r]))
+                r = index;
+        }
+        if(!scaling[s].odf.empty())
+        {
+            voxel.reponse_function_scaling = scaling[s].value;
+            voxel.free_water_diffusion.swap(scaling[s].odf);
+        }
+        if(!response[r].odf.empty())
+            voxel.response_function.swap(response[r].odf);
     }
 };
 
@@ -123,12 +162,11 @@ protected:
 	{
 		SearchLocalMaximum local_max;
         local_max.init(voxel);
-        local_max.search(odf);
-        if (local_max.max_table.size() < 2)
+        float peak_value[2];
+        unsigned short peak_index[2];
+        if (local_max.search(&odf[0],2,peak_value,peak_index) < 2)
             return 0.0;
-        float first_value = local_max.max_table.begin()->first;
-        float second_value = (++(local_max.max_table.begin()))->first;
-        return second_value/first_value;
+        return peak_value[1]/peak_value[0];
     }
 
     void get_error_percentage(Voxel& voxel)
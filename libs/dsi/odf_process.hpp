@@ -13,6 +13,11 @@ public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         data.space.resize(voxel.image_model->dwi_data.size());
+        if(const unsigned short* dwi = voxel.image_model->get_voxel_dwi(data.voxel_index))
+        {
+            std::copy(dwi,dwi+data.space.size(),data.space.begin());
+            return;
+        }
         for (unsigned int index = 0; index < data.space.size(); ++index)
             data.space[index] = voxel.image_model->dwi_data[index][data.voxel_index];
     }
@@ -545,14 +550,14 @@ public:
 
 struct SearchLocalMaximum
 {
-    std::vector<std::vector<unsigned short> > neighbor;
-    std::map<float,unsigned short,std::greater<float> > max_table;
+    // neighbors of vertex i are neighbor_index[neighbor_offset[i]] to neighbor_index[neighbor_offset[i+1]-1]
+    std::vector<unsigned int> neighbor_offset;
+    std::vector<unsigned short> neighbor_index;
     void init(Voxel& voxel)
     {
-
         unsigned int half_odf_size = voxel.ti.half_vertices_count;
         unsigned int faces_count = voxel.ti.faces.size();
-        neighbor.resize(voxel.ti.half_vertices_count);
+        std::vector<std::vector<unsigned short> > neighbor(half_odf_size);
         for (unsigned int index = 0;index < faces_count;++index)
         {
             short i1 = voxel.ti.faces[index][0];
@@ -571,26 +576,57 @@ struct SearchLocalMaximum
             neighbor[i3].push_back(i1);
             neighbor[i3].push_back(i2);
         }
+        neighbor_offset.resize(half_odf_size+1);
+        neighbor_index.clear();
+        for (unsigned int index = 0;index < half_odf_size;++index)
+        {
+            neighbor_offset[index] = neighbor_index.size();
+            neighbor_index.insert(neighbor_index.end(),neighbor[index].begin(),neighbor[index].end());
+        }
+        neighbor_offset[half_odf_size] = neighbor_index.size();
     }
-    void search(const std::vector<float>& old_odf)
+    // The local maxima in descending order of value, at most max_count of them.
+    // Maxima of equal value count once and keep the last vertex, as a map keyed by value would.
+    template<class index_type>
+    unsigned int search(const float* odf,unsigned int max_count,float* peak_value,index_type* peak_index) const
     {
-        max_table.clear();
-        for (unsigned int index = 0;index < neighbor.size();++index)
+        unsigned int count = 0;
+        const unsigned short* nei = neighbor_index.data();
+        for (unsigned int index = 0,size = neighbor_offset.size()-1;index < size;++index)
         {
-            float value = old_odf[index];
+            float value = odf[index];
             bool is_max = true;
-            std::vector<unsigned short>& nei = neighbor[index];
-            for (unsigned int j = 0;j < nei.size();++j)
+            for (unsigned int j = neighbor_offset[index],end = neighbor_offset[index+1];j < end;++j)
             {
-                if (value < old_odf[nei[j]])
+                if (value < odf[nei[j]])
                 {
                     is_max = false;
                     break;
                 }
             }
-            if (is_max)
-                max_table[value] = (unsigned short)index;
+            if (!is_max)
+                continue;
+            unsigned int pos = 0;
+            while(pos < count && peak_value[pos] > value)
+                ++pos;
+            if(pos < count && peak_value[pos] == value)
+            {
+                peak_index[pos] = (index_type)index;
+                continue;
+            }
+            if(pos >= max_count)
+                continue;
+            if(count < max_count)
+                ++count;
+            for(unsigned int j = count-1;j > pos;--j)
+            {
+                peak_value[j] = peak_value[j-1];
+                peak_index[j] = peak_index[j-1];
+            }
+            peak_value[pos] = value;
+            peak_index[pos] = (index_type)index;
         }
+        return count;
     }
 };
 
@@ -598,7 +634,6 @@ struct SearchLocalMaximum
 struct DetermineFiberDirections : public BaseProcess
 {
     SearchLocalMaximum lm;
-    std::mutex mutex;
 public:
     virtual void init(Voxel& voxel)
     {
@@ -608,31 +643,33 @@ public:
     virtual void run(Voxel& voxel,VoxelData& data)
     {
         data.min_odf = *std::min_element(data.odf.begin(),data.odf.end());
-        std::lock_guard<std::mutex> lock(mutex);
-        lm.search(data.odf);
-        std::map<float,unsigned short,std::greater<float> >::const_iterator iter = lm.max_table.begin();
-        std::map<float,unsigned short,std::greater<float> >::const_iterator end = lm.max_table.end();
-        for (unsigned int index = 0;iter != end && index < voxel.max_fiber_number;++index,++iter)
-        {
-            data.dir_index[index] = iter->second;
-            data.fa[index] = iter->first - data.min_odf;
-        }
+        unsigned int count = lm.search(&data.odf[0],voxel.max_fiber_number,&data.fa[0],&data.dir_index[0]);
+        for (unsigned int index = 0;index < count;++index)
+            data.fa[index] -= data.min_odf;
     }
 };
 
 struct ScaleZ0ToMinODF : public BaseProcess
 {
-    float max_min_odf;
+    thread_accumulator<float> max_min_odf;
 public:
     virtual void init(Voxel& voxel)
     {
         voxel.z0 = 0.0;
+        max_min_odf.init(voxel.thread_count,0.0f);
     }
 
     virtual void run(Voxel& voxel,VoxelData& data)
     {
-        if(data.min_odf > voxel.z0)
-            voxel.z0 = data.min_odf;
+        float& value = max_min_odf[data.thread_index];
+        if(data.min_odf > value)
+            value = data.min_odf;
+    }
+    virtual void reduce(Voxel& voxel)
+    {
+        for(unsigned int index = 0;index < max_min_odf.size();++index)
+            if(max_min_odf[index] > voxel.z0)
+                voxel.z0 = max_min_odf[index];
     }
 };
 
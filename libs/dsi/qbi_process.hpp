@@ -138,6 +138,33 @@ public:
             if (data.odf[index] < 0.0)
                 data.odf[index] = 0.0;
     }
+    virtual void run_block(Voxel&, std::vector<VoxelData>& block,unsigned int size)
+    {
+        if(!size)
+            return;
+        std::vector<float> Ht_s(size*half_odf_size),x(size*half_odf_size);
+        std::vector<const float*> space(size),x_ptr(size);
+        std::vector<float*> Ht_s_ptr(size),odf(size);
+        for (unsigned int i = 0; i < size; ++i)
+        {
+            space[i] = &*block[i].space.begin();
+            Ht_s_ptr[i] = &*Ht_s.begin() + i*half_odf_size;
+            x_ptr[i] = &*x.begin() + i*half_odf_size;
+            odf[i] = &*block[i].odf.begin();
+        }
+        // Ht_s = Ht * signal
+        block_vector_product(&*Ht.begin(),&*space.begin(),&*Ht_s_ptr.begin(),half_odf_size,block[0].space.size(),size);
+        // solve HtH * x = Ht_s
+        for (unsigned int i = 0; i < size; ++i)
+            image::mat::lu_solve(iHtH.begin(),iHtH_pivot.begin(),Ht_s.begin() + i*half_odf_size,
+                                 x.begin() + i*half_odf_size,image::dyndim(half_odf_size,half_odf_size));
+        // odf = sG*x
+        block_vector_product(&*sG.begin(),&*x_ptr.begin(),&*odf.begin(),half_odf_size,half_odf_size,size);
+        for (unsigned int i = 0; i < size; ++i)
+            for (unsigned int index = 0; index < block[i].odf.size(); ++index)
+                if (block[i].odf[index] < 0.0)
+                    block[i].odf[index] = 0.0;
+    }
 
 };
 
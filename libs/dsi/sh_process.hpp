@@ -113,6 +113,25 @@ public:
             if (data.odf[index] < 0.0)
                 data.odf[index] = 0.0;
     }
+    virtual void run_block(Voxel& voxel, std::vector<VoxelData>& block,unsigned int size)
+    {
+        if(!size)
+            return;
+        std::vector<const float*> space(size);
+        std::vector<float*> odf(size);
+        for(unsigned int i = 0;i < size;++i)
+        {
+            for(unsigned int index = 0;index < b0_index.size();++index)
+                block[i].space[b0_index[index]] = 0;
+            space[i] = &*block[i].space.begin();
+            odf[i] = &*block[i].odf.begin();
+        }
+        block_vector_product(&*UPiB.begin(),&*space.begin(),&*odf.begin(),half_odf_size,block[0].space.size(),size);
+        for(unsigned int i = 0;i < size;++i)
+            for (unsigned int index = 0; index < block[i].odf.size(); ++index)
+                if (block[i].odf[index] < 0.0)
+                    block[i].odf[index] = 0.0;
+    }
 };
 
 #endif//SH_PROCESS_HPP
@@ -0,0 +1,296 @@
+#ifndef SPARSE_ODF_SOLVER_HPP
+#define SPARSE_ODF_SOLVER_HPP
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+
+/**
+  Per-voxel ODF decomposition (Yeh et al., PLoS ONE 8(10): e75747, 2013) on
+  precomputed Gram matrices, so that only one matrix-vector product is needed
+  for each voxel.
+
+  The stagewise lasso tracks the correlations Rt·residual directly, updating
+  them with a column of G = Rt·Rt' at each step. The fiber weights are then
+  fitted by non-negative least squares on the active set
+  {isotropic, oRt rows}. The normal matrix of the active set is assembled
+  from H = oRt·oRt', and directions that are dropped (negative weights,
+  neighboring directions) are removed from its Cholesky factor with Givens
+  rotations.
+ */
+class sparse_odf_solver{
+    unsigned int n;
+    std::vector<float> Rt,G;
+    std::vector<float> oRt;
+    std::vector<double> H,oRt_sum;
+    const std::vector<std::vector<unsigned char> >* is_neighbor;
+public:
+    struct workspace{
+        std::vector<float> y,corr,w;
+        std::vector<char> fib_map;
+        std::vector<double> L,rhs,x;
+        std::vector<int> columns;
+        // output: isotropic component (if any) followed by the weights of dir_list
+        std::vector<int> dir_list;
+        std::vector<float> results;
+        int has_isotropic;
+    };
+private:
+    unsigned int k_max;
+    // solve L·L'·x = rhs for the k active columns
+    void solve(workspace& ws,unsigned int k) const
+    {
+        const double* L = &ws.L[0];
+        double* x = &ws.x[0];
+        for(unsigned int i = 0;i < k;++i)
+        {
+            double sum = ws.rhs[i];
+            for(unsigned int j = 0;j < i;++j)
+                sum -= L[i*k_max+j]*x[j];
+            x[i] = sum/L[i*k_max+i];
+        }
+        for(int i = k-1;i >= 0;--i)
+        {
+            double sum = x[i];
+            for(unsigned int j = i+1;j < k;++j)
+                sum -= L[j*k_max+i]*x[j];
+            x[i] = sum/L[i*k_max+i];
+        }
+    }
+    // remove active column p from the factor and the right-hand side
+    void remove(workspace& ws,unsigned int k,unsigned int p) const
+    {
+        double* L = &ws.L[0];
+        for(unsigned int i = p;i+1 < k;++i)
+        {
+            std::copy(L+(i+1)*k_max,L+(i+1)*k_max+i+2,L+i*k_max);
+            ws.rhs[i] = ws.rhs[i+1];
+        }
+        // row j now extends to column j+1, rotate it back to lower triangular
+        for(unsigned int j = p;j+1 < k;++j)
+        {
+            double a = L[j*k_max+j],b = L[j*k_max+j+1];
+            double r = std::sqrt(a*a+b*b);
+            double c = a/r,s = b/r;
+            for(unsigned int i = j;i+1 < k;++i)
+            {
+                double u = L[i*k_max+j],v = L[i*k_max+j+1];
+                L[i*k_max+j] = c*u+s*v;
+                L[i*k_max+j+1] = c*v-s*u;
+            }
+            L[j*k_max+j+1] = 0.0;
+        }
+    }
+    // column entry of the normal matrix: index -1 is the isotropic component
+    double normal(int i,int j) const
+    {
+        if(i < 0)
+            return j < 0 ? double(n) : oRt_sum[j];
+        if(j < 0)
+            return oRt_sum[i];
+        return H[i*n+j];
+    }
+    bool factor(workspace& ws,unsigned int k,const int* columns) const
+    {
+        double* L = &ws.L[0];
+        for(unsigned int i = 0;i < k;++i)
+            for(unsigned int j = 0;j <= i;++j)
+            {
+                double sum = normal(columns[i],columns[j]);
+                for(unsigned int t = 0;t < j;++t)
+                    sum -= L[i*k_max+t]*L[j*k_max+t];
+                if(i == j)
+                {
+                    // rank deficient active set
+                    if(sum <= normal(columns[i],columns[i])*1.0e-10)
+                        return false;
+                    L[i*k_max+i] = std::sqrt(sum);
+                }
+                else
+                    L[i*k_max+j] = sum/L[j*k_max+j];
+            }
+        return true;
+    }
+public:
+    sparse_odf_solver(void):n(0),is_neighbor(0),k_max(0){}
+    // Rt: normalized response rows for the lasso, oRt: response rows for the fit
+    void init(const std::vector<float>& Rt_,const std::vector<float>& oRt_,unsigned int half_odf_size,
+              unsigned int max_fiber,const std::vector<std::vector<unsigned char> >& is_neighbor_)
+    {
+        n = half_odf_size;
+        Rt = Rt_;
+        oRt = oRt_;
+        is_neighbor = &is_neighbor_;
+        k_max = max_fiber+1;
+        G.resize(n*n);
+        H.resize(n*n);
+        oRt_sum.resize(n);
+        for(unsigned int i = 0;i < n;++i)
+        {
+            const float* ri = &Rt[i*n];
+            const float* oi = &oRt[i*n];
+            oRt_sum[i] = std::accumulate(oi,oi+n,0.0);
+            for(unsigned int j = 0;j <= i;++j)
+            {
+                const float* rj = &Rt[j*n];
+                const float* oj = &oRt[j*n];
+                double g = 0.0,h = 0.0;
+                for(unsigned int t = 0;t < n;++t)
+                {
+                    g += double(ri[t])*rj[t];
+                    h += double(oi[t])*oj[t];
+                }
+                G[i*n+j] = G[j*n+i] = g;
+                H[i*n+j] = H[j*n+i] = h;
+            }
+        }
+    }
+    void init(workspace& ws) const
+    {
+        ws.y.resize(n);
+        ws.corr.resize(n);
+        ws.w.resize(n);
+        ws.fib_map.resize(n);
+        ws.L.resize(k_max*k_max);
+        ws.rhs.resize(k_max);
+        ws.x.resize(k_max);
+        ws.columns.resize(k_max);
+        ws.dir_list.reserve(k_max);
+        ws.results.reserve(k_max);
+    }
+
+    // stagewise lasso on the normalized odf in ws.y, the weights are left in ws.w
+    void lasso(workspace& ws,float step_size,unsigned int max_fiber) const
+    {
+        float* corr = &ws.corr[0];
+        float* w = &ws.w[0];
+        std::fill(ws.w.begin(),ws.w.end(),0.0f);
+        std::fill(ws.fib_map.begin(),ws.fib_map.end(),0);
+        for(unsigned int i = 0;i < n;++i)
+        {
+            const float* ri = &Rt[i*n];
+            float sum = 0.0f;
+            for(unsigned int t = 0;t < n;++t)
+                sum += ri[t]*ws.y[t];
+            corr[i] = sum;
+        }
+        unsigned int max_iter = ((float)max_fiber/step_size);
+        unsigned int total_fiber = 0;
+        for(unsigned int fib_index = 0;fib_index < max_iter;++fib_index)
+        {
+            unsigned int dir = std::max_element(corr,corr+n)-corr;
+            float c = corr[dir];
+            if(c < 0.0)
+                break;
+            if(!ws.fib_map[dir])
+            {
+                total_fiber++;
+                if(total_fiber > max_fiber)
+                    break;
+                ws.fib_map[dir] = 1;
+            }
+            const float* g = &G[dir*n];
+            float step = c*step_size;
+            if(fib_index == 0)
+            {
+                // step that makes the correlation with dir equal to that of another direction
+                step = std::numeric_limits<float>::max();
+                for(unsigned int j = 0;j < n;++j)
+                {
+                    if(j == dir)
+                        continue;
+                    float t1 = c-corr[j];
+                    float t2 = g[dir]-g[j];
+                    float value = (t2 + 1.0 == 1.0) ? 0.0f : t1/t2;
+                    if(value < step)
+                        step = value;
+                }
+            }
+            w[dir] += step;
+            for(unsigned int j = 0;j < n;++j)
+                corr[j] -= step*g[j];
+        }
+    }
+
+    // fit the lasso directions to odf, return false if the active set is rank deficient
+    bool fit(workspace& ws,const float* odf) const
+    {
+        ws.dir_list.clear();
+        for(unsigned int index = 0;index < n;++index)
+            if(ws.w[index] > 0.0)
+                ws.dir_list.push_back(index);
+        // active columns: isotropic component (-1) followed by dir_list
+        unsigned int k = ws.dir_list.size()+1;
+        if(k > k_max)
+            return false;
+        ws.columns[0] = -1;
+        std::copy(ws.dir_list.begin(),ws.dir_list.end(),ws.columns.begin()+1);
+        if(!factor(ws,k,&ws.columns[0]))
+            return false;
+        ws.rhs[0] = std::accumulate(odf,odf+n,0.0);
+        for(unsigned int i = 1;i < k;++i)
+        {
+            const float* oi = &oRt[ws.columns[i]*n];
+            double sum = 0.0;
+            for(unsigned int t = 0;t < n;++t)
+                sum += oi[t]*odf[t];
+            ws.rhs[i] = sum;
+        }
+        ws.has_isotropic = 1;
+        while(1)
+        {
+            if(ws.dir_list.empty())
+            {
+                ws.results.resize(1);
+                ws.results[0] = std::accumulate(odf,odf+n,0.0)/n;
+                ws.has_isotropic = 1;
+                break;
+            }
+            int has_isotropic = ws.has_isotropic;
+            solve(ws,k);
+            ws.results.assign(ws.x.begin(),ws.x.begin()+k);
+
+            //  drop negative
+            int min_index = std::min_element(ws.results.begin()+has_isotropic,ws.results.end())-ws.results.begin();
+            if(ws.results[min_index] < 0.0)
+            {
+                ws.dir_list.erase(ws.dir_list.begin()+min_index-has_isotropic);
+                remove(ws,k--,min_index);
+                continue;
+            }
+            if(has_isotropic && ws.results[0] < 0.0)
+            {
+                ws.has_isotropic = 0;
+                remove(ws,k--,0);
+                continue;
+            }
+
+            // drop the smallest of neighboring directions
+            int smallest_neighbor = -1;
+            float value = 0.0;
+            for(unsigned int i = 0;i < ws.dir_list.size();++i)
+                for(unsigned int j = i+1;j < ws.dir_list.size();++j)
+                    if((*is_neighbor)[ws.dir_list[i]][ws.dir_list[j]])
+                    {
+                        if(smallest_neighbor == -1 || ws.results[i+has_isotropic] < value)
+                        {
+                            smallest_neighbor = i;
+                            value = ws.results[i+has_isotropic];
+                        }
+                        if(ws.results[j+has_isotropic] < value)
+                        {
+                            smallest_neighbor = j;
+                            value = ws.results[j+has_isotropic];
+                        }
+                    }
+            if(smallest_neighbor == -1)
+                break;
+            ws.dir_list.erase(ws.dir_list.begin()+smallest_neighbor);
+            remove(ws,k--,smallest_neighbor+has_isotropic);
+        }
+        return true;
+    }
+};
+
+#endif//SPARSE_ODF_SOLVER_HPP
@@ -0,0 +1,261 @@
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#ifdef WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include "gzip_interface.hpp"
+
+unsigned int gz_thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+thread_local bool gz_show_prog = true;
+thread_local unsigned int gz_local_thread_count = 0;
+
+void gz_par_for(size_t n,std::function<void(size_t)> fun)
+{
+    unsigned int thread_count = std::min<size_t>(n,std::max<unsigned int>(1,
+                                gz_local_thread_count ? gz_local_thread_count : gz_thread_count));
+    std::atomic<size_t> next(0);
+    auto run = [&]()
+    {
+        for(size_t i;(i = next++) < n;)
+            fun(i);
+    };
+    std::vector<std::thread> threads;
+    for(unsigned int i = 1;i < thread_count;++i)
+        threads.push_back(std::thread(run));
+    run();
+    for(auto& t : threads)
+        t.join();
+}
+
+// member header: gzip id, deflate, FEXTRA, mtime, xfl, os, xlen=12, "DS", len=8, member size, data size
+bool gz_block_index(std::ifstream& in,std::vector<gz_block>& blocks)
+{
+    blocks.clear();
+    in.seekg(0,std::ios::end);
+    size_t file_size = in.tellg();
+    size_t offset = 0,data_offset = 0;
+    while(offset < file_size)
+    {
+        unsigned char header[gz_block_header_size];
+        in.seekg(offset,std::ios::beg);
+        if(!in.read((char*)header,gz_block_header_size) ||
+           header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || header[3] != 4 ||
+           header[10] != 12 || header[11] != 0 || header[12] != 'D' || header[13] != 'S' ||
+           header[14] != 8 || header[15] != 0)
+            break;
+        unsigned int value[2];
+        std::memcpy(value,header+16,8);
+        if(value[0] < gz_block_header_size + 8 || value[0] > file_size-offset)
+            break;
+        gz_block block;
+        block.offset = offset;
+        block.size = value[0];
+        block.data_offset = data_offset;
+        block.data_size = value[1];
+        blocks.push_back(block);
+        offset += value[0];
+        data_offset += value[1];
+    }
+    in.clear();
+    in.seekg(0,std::ios::beg);
+    if(blocks.empty() || offset != file_size)
+    {
+        blocks.clear();
+        return false;
+    }
+    return true;
+}
+
+bool gz_block_deflate(const char* buf,size_t size,std::vector<char>& out)
+{
+    z_stream s;
+    std::memset(&s,0,sizeof(s));
+    if(deflateInit2(&s,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(gz_block_header_size+deflateBound(&s,size)+8);
+    s.next_in = (Bytef*)buf;
+    s.avail_in = size;
+    s.next_out = (Bytef*)&out[gz_block_header_size];
+    s.avail_out = out.size()-gz_block_header_size-8;
+    bool result = (deflate(&s,Z_FINISH) == Z_STREAM_END);
+    size_t deflate_size = s.total_out;
+    deflateEnd(&s);
+    if(!result)
+        return false;
+    unsigned char header[16] = {0x1f,0x8b,8,4,0,0,0,0,0,255,12,0,'D','S',8,0};
+    unsigned int value[2] = {(unsigned int)(gz_block_header_size+deflate_size+8),(unsigned int)size};
+    unsigned int trailer[2] = {(unsigned int)crc32(0,(const Bytef*)buf,size),(unsigned int)size};
+    std::copy(header,header+16,out.begin());
+    std::memcpy(&out[16],value,8);
+    std::memcpy(&out[gz_block_header_size+deflate_size],trailer,8);
+    out.resize(value[0]);
+    return true;
+}
+
+bool gz_block_inflate(const char* member,size_t size,char* out,size_t out_size)
+{
+    z_stream s;
+    std::memset(&s,0,sizeof(s));
+    if(inflateInit2(&s,-15) != Z_OK)
+        return false;
+    s.next_in = (Bytef*)member+gz_block_header_size;
+    s.avail_in = size-gz_block_header_size-8;
+    s.next_out = (Bytef*)out;
+    s.avail_out = out_size;
+    bool result = (inflate(&s,Z_FINISH) == Z_STREAM_END && s.total_out == out_size);
+    inflateEnd(&s);
+    unsigned int trailer[2];
+    std::memcpy(trailer,member+size-8,8);
+    return result && trailer[1] == (unsigned int)out_size &&
+           trailer[0] == (unsigned int)crc32(0,(const Bytef*)out,out_size);
+}
+
+bool gz_istream::read_blocks(void* buf,size_t buf_size)
+{
+    if(pos+buf_size > size_)
+    {
+        close();
+        return false;
+    }
+    char* out = (char*)buf;
+    size_t out_offset = pos,end = pos+buf_size;
+    std::vector<char> members;
+    while(pos < end)
+    {
+        // continue from the last partially read block
+        if(!cache.empty() &&
+           pos >= blocks[cache_block].data_offset &&
+           pos < blocks[cache_block].data_offset+blocks[cache_block].data_size)
+        {
+            size_t from = pos-blocks[cache_block].data_offset;
+            size_t n = std::min(end,blocks[cache_block].data_offset+blocks[cache_block].data_size)-pos;
+            std::copy(cache.begin()+from,cache.begin()+from+n,out+pos-out_offset);
+            pos += n;
+            continue;
+        }
+        // inflate a batch of blocks covering [pos,end)
+        size_t first = std::upper_bound(blocks.begin(),blocks.end(),pos,
+                        [](size_t p,const gz_block& b){return p < b.data_offset;})-blocks.begin()-1;
+        size_t last = first;
+        size_t max_batch = 4*std::max<unsigned int>(1,gz_thread_count);
+        while(last < blocks.size() && blocks[last].data_offset < end && last-first < max_batch)
+            ++last;
+        members.resize(blocks[last-1].offset+blocks[last-1].size-blocks[first].offset);
+        in.seekg(blocks[first].offset,std::ios::beg);
+        if(!in.read(&members[0],members.size()))
+        {
+            close();
+            return false;
+        }
+        std::vector<std::vector<char> > partial(last-first);
+        std::atomic<bool> failed(false);
+        gz_par_for(last-first,[&](size_t i)
+        {
+            const gz_block& b = blocks[first+i];
+            const char* member = &members[b.offset-blocks[first].offset];
+            char* dest = 0;
+            if(b.data_offset >= pos && b.data_offset+b.data_size <= end)
+                dest = out+b.data_offset-out_offset;
+            else
+            {
+                partial[i].resize(b.data_size);
+                dest = partial[i].empty() ? 0:&partial[i][0];
+            }
+            if(b.data_size && !gz_block_inflate(member,b.size,dest,b.data_size))
+                failed = true;
+        });
+        if(failed)
+        {
+            close();
+            return false;
+        }
+        for(size_t i = 0;i < partial.size();++i)
+            if(!partial[i].empty())
+            {
+                const gz_block& b = blocks[first+i];
+                size_t from = std::max(pos,b.data_offset);
+                size_t to = std::min(end,b.data_offset+b.data_size);
+                std::copy(partial[i].begin()+from-b.data_offset,partial[i].begin()+to-b.data_offset,out+from-out_offset);
+                cache.swap(partial[i]);
+                cache_block = first+i;
+            }
+        pos = std::min(end,blocks[last-1].data_offset+blocks[last-1].data_size);
+    }
+    return true;
+}
+
+bool gz_ostream::write_blocks(void)
+{
+    size_t block_count = std::max<size_t>(1,(buffer.size()+gz_block_size-1)/gz_block_size);
+    std::vector<std::vector<char> > members(block_count);
+    std::atomic<bool> failed(false);
+    gz_par_for(block_count,[&](size_t i)
+    {
+        size_t from = i*gz_block_size;
+        size_t size = std::min(buffer.size()-from,gz_block_size);
+        if(!gz_block_deflate(buffer.empty() ? 0:&buffer[from],size,members[i]))
+            failed = true;
+    });
+    buffer.clear();
+    if(failed)
+        return false;
+    for(size_t i = 0;i < members.size();++i)
+        out.write(&members[i][0],members[i].size());
+    has_block = true;
+    return out.good();
+}
+
+// the process id keeps concurrent tools writing the same file apart, and the
+// .gz suffix is kept so that the temporary file is compressed like the file
+std::string gz_temp_file_name(const std::string& file_name)
+{
+    std::ostringstream out;
+#ifdef WIN32
+    out << file_name << "." << _getpid() << ".tmp";
+#else
+    out << file_name << "." << getpid() << ".tmp";
+#endif
+    if(file_name.length() > 3 && file_name.compare(file_name.length()-3,3,".gz") == 0)
+        out << ".gz";
+    return out.str();
+}
+bool gz_replace_file(const std::string& temp_file,const std::string& file_name)
+{
+    // rename replaces the file atomically on POSIX, but fails on Windows if the file exists
+    if(std::rename(temp_file.c_str(),file_name.c_str()) == 0)
+        return true;
+#ifdef WIN32
+    // the old file is removed only now, and the output is kept if the rename still fails
+    std::remove(file_name.c_str());
+    return std::rename(temp_file.c_str(),file_name.c_str()) == 0;
+#else
+    std::remove(temp_file.c_str());
+    return false;
+#endif
+}
+
+bool gz_mat_stream::next(void)
+{
+    // each matrix: type, rows, cols, imagf, name length, name, data
+    unsigned int header[5];
+    if(!in.read(header,sizeof(header)) ||
+       header[3] || !header[4] || header[4] > 1024 || !mmap_mat_element_size(header[0]))
+        return false;
+    std::vector<char> name_buf(header[4]);
+    if(!in.read(&name_buf[0],name_buf.size()))
+        return false;
+    name_buf.back() = 0;
+    name = &name_buf[0];
+    type = header[0];
+    rows = header[1];
+    cols = header[2];
+    data.resize((size_t)rows*cols*mmap_mat_element_size(type));
+    return data.empty() || in.read(&data[0],data.size());
+}
@@ -7,7 +7,34 @@
 #endif
 #include "image/image.hpp"
 #include "prog_interface_static_link.h"
+#include "mmap_mat.hpp"
 extern bool prog_aborted_;
+
+/*
+ .gz files are written as a series of independent gzip members, each holding
+ gz_block_size bytes of data, so that the members can be deflated and inflated
+ in parallel. Any gzip reader can still read them as one stream. The extra
+ field "DS" of each member header records the member size and its data size,
+ which allows the reader to index all members without inflating them.
+ */
+const size_t gz_block_size = 4194304;// 4mb
+const size_t gz_block_header_size = 24;
+extern unsigned int gz_thread_count;
+// cleared on worker threads, so that the gz_istream they open neither reports
+// progress nor resets or checks the abort flag of the progress dialog
+extern thread_local bool gz_show_prog;
+// set on worker threads that already run in parallel (e.g. to 1), so that the
+// members each of them inflates or deflates are not spread over gz_thread_count
+// more threads; 0 uses gz_thread_count
+extern thread_local unsigned int gz_local_thread_count;
+struct gz_block{
+    size_t offset,size;         // member location in the file
+    size_t data_offset,data_size;// inflated location
+};
+bool gz_block_index(std::ifstream& in,std::vector<gz_block>& blocks);
+bool gz_block_deflate(const char* buf,size_t size,std::vector<char>& out);
+bool gz_block_inflate(const char* member,size_t size,char* out,size_t out_size);
+
 class gz_istream{
     size_t size_;
     std::ifstream in;
@@ -22,8 +49,15 @@ class gz_istream{
             return true;
         return false;
     }
+private:// indexed gzip members
+    std::vector<gz_block> blocks;
+    size_t pos;
+    std::vector<char> cache;
+    size_t cache_block;
+    bool read_blocks(void* buf,size_t buf_size);
+    bool show_prog;
 public:
-    gz_istream(void):size_(0),handle(0){}
+    gz_istream(void):size_(0),handle(0),pos(0),cache_block(0),show_prog(gz_show_prog){}
     ~gz_istream(void)
     {
         close();
@@ -32,7 +66,9 @@ public:
     template<class char_type>
     bool open(const char_type* file_name)
     {
-        prog_aborted_ = false;
+        show_prog = gz_show_prog;
+        if(show_prog)
+            prog_aborted_ = false;
         in.open(file_name,std::ios::binary);
         unsigned int gz_size = 0;
         if(in)
@@ -44,6 +80,14 @@ public:
         }
         if(is_gz(file_name))
         {
+            if(in && gz_block_index(in,blocks))
+            {
+                size_ = blocks.back().data_offset+blocks.back().data_size;
+                pos = 0;
+                cache.clear();
+                return true;
+            }
+            blocks.clear();
             in.close();
             size_ = gz_size;
             handle = gzopen(file_name, "rb");
@@ -53,9 +97,14 @@ public:
     }
     bool read(void* buf,size_t buf_size)
     {
-        check_prog((unsigned int)cur(),(unsigned int)size());
-        if(prog_aborted())
-            return false;
+        if(show_prog)
+        {
+            check_prog((unsigned int)cur(),(unsigned int)size());
+            if(prog_aborted())
+                return false;
+        }
+        if(!blocks.empty())
+            return read_blocks(buf,buf_size);
         if(handle)
         {
 
@@ -85,16 +134,21 @@ public:
             }
         return false;
     }
-    void seek(long pos)
+    void seek(long pos_)
     {
+        if(!blocks.empty())
+        {
+            pos = pos_;
+            return;
+        }
         if(handle)
         {
-            if(gzseek(handle,pos,SEEK_SET) == -1)
+            if(gzseek(handle,pos_,SEEK_SET) == -1)
                 close();
         }
         else
             if(in)
-                in.seekg(pos,std::ios::beg);
+                in.seekg(pos_,std::ios::beg);
     }
     void close(void)
     {
@@ -105,10 +159,30 @@ public:
         }
         if(in)
             in.close();
-        check_prog(0,0);
+        blocks.clear();
+        cache.clear();
+        if(show_prog)
+            check_prog(0,0);
+    }
+    // true only when the stream ends exactly at the current position
+    bool at_end(void)
+    {
+        if(!blocks.empty())
+            return pos >= size_;
+        if(handle)
+        {
+            int c = gzgetc(handle);
+            if(c == -1)
+                return gzeof(handle);
+            gzungetc(c,handle);
+            return false;
+        }
+        return in.peek() == std::char_traits<char>::eof();
     }
     size_t cur(void)
     {
+        if(!blocks.empty())
+            return pos;
         return handle ? (size_t)gztell(handle):(size_t)in.tellg();
     }
     size_t size(void)
@@ -122,7 +196,7 @@ public:
 
 class gz_ostream{
     std::ofstream out;
-    gzFile handle;
+    bool gz;
     bool is_gz(const char* file_name)
     {
         std::string filename = file_name;
@@ -133,8 +207,12 @@ class gz_ostream{
             return true;
         return false;
     }
+private:// data waiting to be deflated, up to gz_block_size per thread
+    std::vector<char> buffer;
+    bool has_block;
+    bool write_blocks(void);
 public:
-    gz_ostream(void):handle(0){}
+    gz_ostream(void):gz(false),has_block(false){}
     ~gz_ostream(void)
     {
         close();
@@ -143,53 +221,126 @@ public:
     template<class char_type>
     bool open(const char_type* file_name)
     {
-        if(is_gz(file_name))
-        {
-            handle = gzopen(file_name, "wb");
-            return handle;
-        }
+        gz = is_gz(file_name);
+        has_block = false;
+        buffer.clear();
         out.open(file_name,std::ios::binary);
         return out.good();
     }
     void write(const void* buf,size_t size)
     {
-        if(handle)
+        if(!out)
+            return;
+        if(gz)
         {
-            const size_t block_size = 524288000;// 500mb
-            while(size > block_size)
+            size_t buffer_size = gz_block_size*std::max<unsigned int>(1,gz_thread_count);
+            while(size)
             {
-                if(gzwrite(handle,buf,block_size) <= 0)
+                size_t n = std::min(size,buffer_size-buffer.size());
+                buffer.insert(buffer.end(),(const char*)buf,(const char*)buf+n);
+                size -= n;
+                buf = (const char*)buf + n;
+                if(buffer.size() == buffer_size && !write_blocks())
                 {
                     close();
                     throw std::runtime_error("Cannot output gz file");
                 }
-                size -= block_size;
-                buf = (const char*)buf + block_size;
             }
-            if(gzwrite(handle,buf,(unsigned int)size) <= 0)
-                close();
         }
         else
-            if(out)
-                out.write((const char*)buf,size);
+            out.write((const char*)buf,size);
     }
     void close(void)
     {
-        if(handle)
-        {
-            gzclose(handle);
-            handle = 0;
-        }
+        if(gz && out && (!buffer.empty() || !has_block))
+            write_blocks();
+        gz = false;
+        buffer.clear();
         if(out)
             out.close();
     }
-    operator bool() const	{return handle? true:out.good();}
-    bool operator!() const	{return !(handle? true:out.good());}
+    operator bool() const	{return out.good();}
+    bool operator!() const	{return !out.good();}
 };
 
 
 typedef image::io::nifti_base<gz_istream,gz_ostream> gz_nifti;
 typedef image::io::mat_write_base<gz_ostream> gz_mat_write;
-typedef image::io::mat_read_base<gz_istream> gz_mat_read;
+// output is written to gz_temp_file_name(file_name) and moved over the file by
+// gz_replace_file once complete, so a failed write never leaves a partial file
+std::string gz_temp_file_name(const std::string& file_name);
+bool gz_replace_file(const std::string& temp_file,const std::string& file_name);
+// reads the matrices of a .fib.gz/.src.gz file one at a time, so that a file can
+// be copied without holding all of its matrices in memory
+class gz_mat_stream
+{
+    gz_istream in;
+public:
+    std::string name;
+    unsigned int type,rows,cols;
+    std::vector<char> data;
+public:
+    bool open(const char* file_name){return in.open(file_name);}
+    bool at_end(void){return in.at_end();}
+    // false if the next matrix is missing or malformed
+    bool next(void);
+    void write_to(gz_mat_write& writer) const
+    {
+        mmap_mat_write_to(writer,name.c_str(),type,rows,cols,data.empty() ? 0:&data[0]);
+    }
+};
+typedef image::io::mat_read_base<gz_istream> gz_mat_read_base;
+
+// reads .fib.gz/.src.gz files into memory, or maps a memory-mapped container (mmap_mat.hpp)
+class gz_mat_read : public gz_mat_read_base
+{
+    std::shared_ptr<mmap_mat_read> mm;
+public:
+    // extra arguments (e.g. max_count, stop_name) are passed to the partial load of
+    // gz_mat_read_base; a memory-mapped container is never loaded, so it ignores them
+    template<class... args_type>
+    bool load_from_file(const char* file_name,args_type... args)
+    {
+        mm.reset();
+        if(mmap_mat_read::is_mmap_mat(file_name))
+        {
+            mm.reset(new mmap_mat_read);
+            if(mm->load_from_file(file_name))
+                return true;
+            mm.reset();
+            return false;
+        }
+        return gz_mat_read_base::load_from_file(file_name,args...);
+    }
+    template<class data_type>
+    bool read(int index,unsigned int& rows,unsigned int& cols,const data_type*& out)
+    {
+        if(mm.get())
+            return mm->read(index,rows,cols,out);
+        return gz_mat_read_base::read(index,rows,cols,out);
+    }
+    template<class data_type>
+    bool read(const char* name,unsigned int& rows,unsigned int& cols,const data_type*& out)
+    {
+        if(mm.get())
+            return mm->read(name,rows,cols,out);
+        return gz_mat_read_base::read(name,rows,cols,out);
+    }
+    unsigned int size(void)
+    {
+        return mm.get() ? mm->size():gz_mat_read_base::size();
+    }
+    std::string name(unsigned int index)
+    {
+        return mm.get() ? mm->name(index):std::string(gz_mat_read_base::name(index));
+    }
+    void write_to(gz_mat_write& writer,unsigned int index)
+    {
+        if(mm.get())
+            mm->write_to(writer,index);
+        else
+            writer.write((*this)[index]);
+    }
+};
 
 #endif // GZIP_INTERFACE_HPP
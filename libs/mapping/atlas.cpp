@@ -239,3 +239,53 @@ bool atlas::label_matched(uint64_t l,unsigned int label_name_index)
     return std::find(index2label[l].begin(),index2label[l].end(),label_name_index) != index2label[l].end();
 }
 
+
+// the image label at each mni position, looked up once per voxel
+void atlas::get_label_volume(const image::basic_image<image::vector<3,float>,3>& mni_position,
+                             image::basic_image<uint64_t,3>& label_volume)
+{
+    if(I.empty())
+        load_from_file();
+    label_volume.resize(mni_position.geometry());
+    image::par_for(mni_position.size(),[&](int index)
+    {
+        label_volume[index] = get_label_at(mni_position[index]);
+    });
+}
+
+// voxel indices of every region in one sweep of the label volume,
+// regions matched by an image label are resolved once for each distinct label
+void atlas::get_region_voxels(const image::basic_image<uint64_t,3>& label_volume,
+                              std::vector<std::vector<unsigned int> >& region_voxels,
+                              const image::basic_image<unsigned char,3>* mask)
+{
+    unsigned int region_count = get_list().size();
+    region_voxels.clear();
+    region_voxels.resize(region_count);
+    std::map<uint64_t,std::vector<unsigned int> > matched_regions;
+    const std::vector<unsigned int>* regions = 0;
+    uint64_t last_label = 0;
+    for(unsigned int index = 0;index < label_volume.size();++index)
+    {
+        if(mask && !(*mask)[index])
+            continue;
+        uint64_t l = label_volume[index];
+        if(!regions || l != last_label)
+        {
+            auto iter = matched_regions.find(l);
+            if(iter == matched_regions.end())
+            {
+                std::vector<unsigned int>& new_regions = matched_regions[l];
+                for(unsigned int i = 0;i < region_count;++i)
+                    if(label_matched(l,i))
+                        new_regions.push_back(i);
+                regions = &new_regions;
+            }
+            else
+                regions = &iter->second;
+            last_label = l;
+        }
+        for(unsigned int i = 0;i < regions->size();++i)
+            region_voxels[(*regions)[i]].push_back(index);
+    }
+}
@@ -42,6 +42,12 @@ public:
     std::string get_label_name_at(const image::vector<3,float>& mni_space);
     bool is_labeled_as(const image::vector<3,float>& mni_space,unsigned int label);
     bool label_matched(uint64_t image_label,unsigned int region_label);
+public:// resolve a whole volume at once
+    void get_label_volume(const image::basic_image<image::vector<3,float>,3>& mni_position,
+                          image::basic_image<uint64_t,3>& label_volume);
+    void get_region_voxels(const image::basic_image<uint64_t,3>& label_volume,
+                           std::vector<std::vector<unsigned int> >& region_voxels,
+                           const image::basic_image<unsigned char,3>* mask = 0);
 };
 
 #endif // ATLAS_HPP
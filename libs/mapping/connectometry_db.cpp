@@ -1,5 +1,11 @@
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <cstdio>
+#include <cctype>
 #include "connectometry_db.hpp"
 #include "fib_data.hpp"
+#include "block_product.hpp"
 
 void connectometry_db::read_db(fib_data* handle_)
 {
@@ -51,6 +57,7 @@ void connectometry_db::read_db(fib_data* handle_)
     }
 
     calculate_si2vi();
+    clear_voxel_qa();
 }
 
 void connectometry_db::remove_subject(unsigned int index)
@@ -62,9 +69,11 @@ void connectometry_db::remove_subject(unsigned int index)
     subject_names.erase(subject_names.begin()+index);
     R2.erase(R2.begin()+index);
     --num_subjects;
+    clear_voxel_qa();
 }
 void connectometry_db::calculate_si2vi(void)
 {
+    si2vi.clear();
     vi2si.resize(handle->dim);
     for(unsigned int index = 0;index < (unsigned int)handle->dim.size();++index)
     {
@@ -75,12 +84,46 @@ void connectometry_db::calculate_si2vi(void)
         }
     }
 }
-bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
+void connectometry_db::clear_voxel_qa(void)
+{
+    std::lock_guard<std::mutex> lock(voxel_qa_lock);
+    voxel_qa = 0;
+    voxel_qa_stride = 0;
+    std::vector<float>().swap(voxel_qa_buf);
+}
+bool connectometry_db::build_voxel_qa(void)
+{
+    std::lock_guard<std::mutex> lock(voxel_qa_lock);
+    if(voxel_qa)
+        return true;
+    if(!num_subjects || !subject_qa_length)
+        return false;
+    unsigned int stride = (num_subjects+15) & ~15u;
+    voxel_qa_buf.resize(size_t(subject_qa_length)*stride+16);
+    float* buf = &voxel_qa_buf[0];
+    buf += (16-((size_t)buf/sizeof(float))%16)%16;
+    // transpose in blocks of positions so that each subject array is read sequentially
+    const unsigned int block_size = 256;
+    image::par_for((subject_qa_length+block_size-1)/block_size,[&](int block)
+    {
+        unsigned int from = block*block_size;
+        unsigned int to = std::min<unsigned int>(from+block_size,subject_qa_length);
+        for(unsigned int subject = 0;subject < num_subjects;++subject)
+        {
+            const float* qa = subject_qa[subject];
+            for(unsigned int pos = from;pos < to;++pos)
+                buf[size_t(pos)*stride+subject] = qa[pos];
+        }
+    });
+    voxel_qa = buf;
+    voxel_qa_stride = stride;
+    return true;
+}
+bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data) const
 {
     odf_data subject_odf;
     if(!subject_odf.read(m))
         return false;
-    set_title("load data");
     for(unsigned int index = 0;index < si2vi.size();++index)
     {
         unsigned int cur_index = si2vi[index];
@@ -99,7 +142,7 @@ bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
     }
     return true;
 }
-bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name)
+bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name) const
 {
     const float* index_of_interest = 0;
     unsigned int row,col;
@@ -119,18 +162,22 @@ bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,cons
     return true;
 }
 bool connectometry_db::is_consistent(gz_mat_read& m)
+{
+    return is_consistent(m,handle->error_msg);
+}
+bool connectometry_db::is_consistent(gz_mat_read& m,std::string& error_msg) const
 {
     unsigned int row,col;
     const float* odf_buffer = 0;
     m.read("odf_vertices",row,col,odf_buffer);
     if (!odf_buffer)
     {
-        handle->error_msg = "No odf_vertices matrix in ";
+        error_msg = "No odf_vertices matrix in ";
         return false;
     }
     if(col != handle->dir.odf_table.size())
     {
-        handle->error_msg = "Inconsistent ODF dimension in ";
+        error_msg = "Inconsistent ODF dimension in ";
         return false;
     }
     for (unsigned int index = 0;index < col;++index,odf_buffer += 3)
@@ -139,7 +186,7 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
            handle->dir.odf_table[index][1] != odf_buffer[1] ||
            handle->dir.odf_table[index][2] != odf_buffer[2])
         {
-            handle->error_msg = "Inconsistent ODF in ";
+            error_msg = "Inconsistent ODF in ";
             return false;
         }
     }
@@ -147,91 +194,337 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
     m.read("voxel_size",row,col,voxel_size);
     if(!voxel_size)
     {
-        handle->error_msg = "No voxel_size matrix in ";
+        error_msg = "No voxel_size matrix in ";
         return false;
     }
     if(voxel_size[0] != handle->vs[0])
     {
         std::ostringstream out;
         out << "Inconsistency in image resolution. Please use a correct atlas. The atlas resolution (" << handle->vs[0] << " mm) is different from that in ";
-        handle->error_msg = out.str();
+        error_msg = out.str();
         return false;
     }
     return true;
 }
 
-bool connectometry_db::load_subject_files(const std::vector<std::string>& file_names,
-                        const std::vector<std::string>& subject_names_,
-                        const char* index_name)
+// sample one subject file into data (subject_qa_length values, zero where not sampled)
+bool connectometry_db::load_subject_file(const std::string& file_name,const char* index_name,
+                                         std::vector<float>& data,float& r2,std::string& report,std::string& error_msg) const
 {
-    num_subjects = (unsigned int)file_names.size();
-    subject_qa.clear();
-    subject_qa.resize(num_subjects);
-    subject_qa_buf.resize(num_subjects);
-    R2.resize(num_subjects);
-    for(unsigned int index = 0;index < num_subjects;++index)
-        subject_qa_buf[index].resize(handle->dir.num_fiber*si2vi.size());
-    for(unsigned int index = 0;index < num_subjects;++index)
-        subject_qa[index] = &(subject_qa_buf[index][0]);
-    for(unsigned int subject_index = 0;check_prog(subject_index,num_subjects);++subject_index)
+    gz_mat_read m;
+    if(!m.load_from_file(file_name.c_str()))
     {
-        if(prog_aborted())
+        error_msg = "failed to load subject data ";
+        error_msg += file_name;
+        return false;
+    }
+    data.resize(subject_qa_length);
+    std::fill(data.begin(),data.end(),0.0f);
+    // check if the odf table is consistent or not
+    if(std::string(index_name) == "sdf")
+    {
+        if(!is_consistent(m,error_msg))
         {
-            check_prog(1,1);
+            error_msg += file_name;
             return false;
         }
-        gz_mat_read m;
-        if(!m.load_from_file(file_names[subject_index].c_str()))
+        if(!sample_odf(m,data))
         {
-            handle->error_msg = "failed to load subject data ";
-            handle->error_msg += file_names[subject_index];
+            error_msg = "Failed to read odf ";
+            error_msg += file_name;
             return false;
         }
-        // check if the odf table is consistent or not
-        if(std::string(index_name) == "sdf")
+    }
+    else
+    {
+        if(!sample_index(m,data,index_name))
         {
-            if(!is_consistent(m))
+            error_msg = "failed to sample ";
+            error_msg += index_name;
+            error_msg += " in ";
+            error_msg += file_name;
+            return false;
+        }
+    }
+    // load R2
+    const float* value= 0;
+    unsigned int row,col;
+    m.read("R2",row,col,value);
+    if(!value || *value != *value)
+    {
+        error_msg = "Invalid R2 value in ";
+        error_msg += file_name;
+        return false;
+    }
+    r2 = *value;
+    const char* report_buf = 0;
+    if(m.read("report",row,col,report_buf))
+        report = std::string(report_buf,report_buf+row*col);
+    return true;
+}
+
+/*
+ Build a database file directly from subject files. Subjects are decompressed and
+ sampled by thread_count workers and written to the output in subject order as soon
+ as they are ready, so at most 2*thread_count subject vectors are held at any time.
+ If the template already holds a database, its subjects are copied from the template
+ file one matrix at a time and the new subjects are appended after them, so the
+ existing subjects are never loaded together.
+ The database is written to a temporary file and renamed when complete, so a
+ failed or aborted run leaves no partial output.
+ */
+bool connectometry_db::save_subject_files(const std::vector<std::string>& file_names,
+                        const std::vector<std::string>& subject_names_,
+                        const char* index_name,const char* output_name,unsigned int thread_count)
+{
+    std::string temp_file = gz_temp_file_name(output_name);
+    bool result = false;
+    {
+        gz_mat_write matfile(temp_file.c_str());
+        if(!matfile)
+        {
+            handle->error_msg = "Cannot output file";
+            return false;
+        }
+        result = write_subject_files(matfile,file_names,subject_names_,index_name,thread_count);
+    }
+    if(!result)
+    {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    if(!gz_replace_file(temp_file,output_name))
+    {
+        handle->error_msg = "Cannot output file";
+        return false;
+    }
+    return true;
+}
+bool connectometry_db::write_subject_files(gz_mat_write& matfile,const std::vector<std::string>& file_names,
+                        const std::vector<std::string>& subject_names_,
+                        const char* index_name,unsigned int thread_count)
+{
+    subject_qa_length = handle->dir.num_fiber*(unsigned int)si2vi.size();
+    // the subject names, R2, and report are rewritten at the end
+    unsigned int existing_count = 0;
+    std::string existing_names;
+    std::vector<float> all_R2;
+    bool has_R2 = false;
+    auto is_subject_matrix = [](const std::string& name)
+    {
+        return name.size() > 7 && name.compare(0,7,"subject") == 0 && std::isdigit(name[7]);
+    };
+    auto copy_matrix = [&](const std::string& name,unsigned int type,unsigned int rows,unsigned int cols,const void* data)->bool
+    {
+        if(name == "report")
+            return true;
+        if(name == "subject_names")
+        {
+            if((type/10)%10 == 5)
+                existing_names = std::string((const char*)data,(const char*)data+size_t(rows)*cols);
+            return true;
+        }
+        if(name == "R2")
+        {
+            if((type/10)%10 == 1)
             {
-                handle->error_msg += file_names[subject_index];
-                return false;
+                all_R2.assign((const float*)data,(const float*)data+size_t(rows)*cols);
+                has_R2 = true;
             }
-            if(!sample_odf(m,subject_qa_buf[subject_index]))
+            return true;
+        }
+        if(is_subject_matrix(name))
+        {
+            if(size_t(rows)*cols != subject_qa_length)
             {
-                handle->error_msg = "Failed to read odf ";
-                handle->error_msg += file_names[subject_index];
+                handle->error_msg = "Inconsistent subject data in the template database";
                 return false;
             }
+            ++existing_count;
         }
-        else
+        mmap_mat_write_to(matfile,name.c_str(),type,rows,cols,data);
+        return true;
+    };
+    if(mmap_mat_read::is_mmap_mat(handle->fib_file_name.c_str()))
+    {
+        // a mapped matrix is only paged in while it is copied
+        for(unsigned int index = 0;index < handle->mat_reader.size();++index)
         {
-            if(!sample_index(m,subject_qa_buf[subject_index],index_name))
+            std::string name = handle->mat_reader.name(index);
+            unsigned int rows,cols,type;
+            const void* data = 0;
+            if(name == "subject_names")
             {
-                handle->error_msg = "failed to sample ";
-                handle->error_msg += index_name;
-                handle->error_msg += " in ";
-                handle->error_msg += file_names[subject_index];
+                const char* text = 0;
+                handle->mat_reader.read(index,rows,cols,text);
+                data = text;
+                type = mmap_mat_type<char>::value;
+            }
+            else
+            if(name == "R2" || is_subject_matrix(name))
+            {
+                const float* values = 0;
+                handle->mat_reader.read(index,rows,cols,values);
+                data = values;
+                type = mmap_mat_type<float>::value;
+            }
+            else
+            {
+                if(name != "report")
+                    handle->mat_reader.write_to(matfile,index);
+                continue;
+            }
+            if(!data)
+            {
+                handle->error_msg = "Cannot read the template file";
                 return false;
             }
+            if(!copy_matrix(name,type,rows,cols,data))
+                return false;
         }
-        // load R2
-        const float* value= 0;
-        unsigned int row,col;
-        m.read("R2",row,col,value);
-        if(!value || *value != *value)
+    }
+    else
+    {
+        // only the matrices up to the first subject are loaded by
+        // vbc_database::create_database; the rest is streamed from the file
+        gz_mat_stream in;
+        if(!in.open(handle->fib_file_name.c_str()))
         {
-            handle->error_msg = "Invalid R2 value in ";
-            handle->error_msg += file_names[subject_index];
+            handle->error_msg = "Cannot read the template file";
             return false;
         }
-        R2[subject_index] = *value;
-        if(subject_index == 0)
+        while(!in.at_end())
+        {
+            if(!in.next())
+            {
+                handle->error_msg = "Cannot read the template file";
+                return false;
+            }
+            if(!copy_matrix(in.name,in.type,in.rows,in.cols,in.data.empty() ? 0:&in.data[0]))
+                return false;
+        }
+    }
+    if(existing_count && !has_R2)
+    {
+        handle->error_msg = "Invalid template database: cannot find R2";
+        return false;
+    }
+    all_R2.resize(existing_count);
+    if(prog_aborted())
+    {
+        handle->error_msg = "aborted";
+        return false;
+    }
+
+    const unsigned int count = file_names.size();
+    thread_count = std::max<unsigned int>(1,std::min<unsigned int>(thread_count,count));
+    const unsigned int window = thread_count*2;
+    std::vector<std::vector<float> > buf(window);
+    std::vector<unsigned char> ready(window);
+    std::vector<float> new_R2(count);
+    std::string new_report,error_msg;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::atomic<unsigned int> next_subject(0);
+    unsigned int written = 0;
+    bool failed = false;
+    auto run = [&](void)
+    {
+        // only the writing thread below touches the progress dialog and its abort flag
+        gz_show_prog = false;
+        // the subjects are already loaded in parallel, one inflating thread each
+        gz_local_thread_count = 1;
+        for(unsigned int i;(i = next_subject++) < count;)
+        {
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                cv.wait(lk,[&](){return failed || i < written+window;});
+                if(failed)
+                    return;
+            }
+            std::string report,msg;
+            if(!load_subject_file(file_names[i],index_name,buf[i % window],new_R2[i],report,msg))
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                if(!failed)
+                    error_msg = msg;
+                failed = true;
+                cv.notify_all();
+                return;
+            }
+            std::lock_guard<std::mutex> lk(lock);
+            if(i == 0)
+                new_report = report;
+            ready[i % window] = 1;
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for(unsigned int index = 0;index < thread_count;++index)
+        threads.push_back(std::thread(run));
+    // written in order by this thread, which also reports the progress
+    for(;check_prog(written,count);)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait_for(lk,std::chrono::milliseconds(100),[&](){return failed || ready[written % window];});
+        if(!failed && prog_aborted())
+        {
+            error_msg = "aborted";
+            failed = true;
+        }
+        if(failed)
+        {
+            cv.notify_all();
+            break;
+        }
+        if(!ready[written % window])
+            continue;
+        lk.unlock();
+        std::ostringstream out;
+        out << "subject" << existing_count+written;
+        matfile.write(out.str().c_str(),&buf[written % window][0],handle->dir.num_fiber,(unsigned int)si2vi.size());
+        lk.lock();
+        ready[written % window] = 0;
+        ++written;
+        cv.notify_all();
+    }
+    for(unsigned int index = 0;index < threads.size();++index)
+        threads[index].join();
+    if(failed)
+    {
+        check_prog(1,1);
+        handle->error_msg = error_msg;
+        return false;
+    }
+
+    std::string name_string;
+    {
+        std::istringstream in(existing_names);
+        for(unsigned int index = 0;index < existing_count;++index)
         {
-            const char* report_buf = 0;
-            if(m.read("report",row,col,report_buf))
-                subject_report = std::string(report_buf,report_buf+row*col);
+            std::string line;
+            std::getline(in,line);
+            name_string += line;
+            name_string += "\n";
         }
     }
-    subject_names = subject_names_;
+    for(unsigned int index = 0;index < count;++index)
+    {
+        name_string += subject_names_[index];
+        name_string += "\n";
+    }
+    matfile.write("subject_names",name_string.c_str(),1,(unsigned int)name_string.size());
+    all_R2.insert(all_R2.end(),new_R2.begin(),new_R2.end());
+    if(!all_R2.empty())
+        matfile.write("R2",&*all_R2.begin(),1,(unsigned int)all_R2.size());
+    if(!existing_count || subject_report.empty())
+        subject_report = new_report;
+    {
+        std::ostringstream out;
+        out << "A total of " << existing_count+count << " subjects were included in the connectometry database." << subject_report.c_str();
+        std::string report = out.str();
+        matfile.write("report",&*report.c_str(),1,(unsigned int)report.length());
+    }
     return true;
 }
 void connectometry_db::get_subject_vector(std::vector<std::vector<float> >& subject_vector,
@@ -357,9 +650,9 @@ void connectometry_db::save_subject_data(const char* output_name)
         return;
     }
     for(unsigned int index = 0;index < handle->mat_reader.size();++index)
-        if(handle->mat_reader[index].get_name() != "report" &&
-           handle->mat_reader[index].get_name().find("subject") != 0)
-            matfile.write(handle->mat_reader[index]);
+        if(handle->mat_reader.name(index) != "report" &&
+           handle->mat_reader.name(index).find("subject") != 0)
+            handle->mat_reader.write_to(matfile,index);
     for(unsigned int index = 0;check_prog(index,(unsigned int)subject_qa.size());++index)
     {
         std::ostringstream out;
@@ -526,15 +819,438 @@ bool connectometry_db::add_db(const connectometry_db& rhs)
     subject_qa.resize(num_subjects);
     for(unsigned int index = 0;index < subject_qa_buf.size();++index)
         subject_qa[num_subjects+index-subject_qa_buf.size()] = &(subject_qa_buf[index][0]);
+    clear_voxel_qa();
+    return true;
 }
 
 
 
+// stat_model::operator() for a block of fiber positions. The selected subjects are gathered once
+// per position without allocation, and the regression coefficients of all positions are obtained
+// as one product with (X'X)^-1 X', which is computed once for the current design matrix.
+class stat_model_batch{
+    const stat_model& model;
+    unsigned int n,p;
+    std::vector<unsigned int> order;// db subject of each sample, group 0 before group 1
+    std::vector<double> y;
+private:// multiple regression
+    std::vector<double> pinv;// (X'X)^-1 X', p by n
+    std::vector<double> cov;// (X'X)^-1
+    double cov_study;
+    std::vector<double> b;
+    bool solve(const double* yi,double* bi,double& t) const
+    {
+        for(unsigned int k = 0;k < p;++k)
+            bi[k] = image::vec::dot(&pinv[k*n],&pinv[k*n]+n,yi);
+        double rss = 0.0;
+        for(unsigned int i = 0;i < n;++i)
+        {
+            double r = yi[i]-image::vec::dot(&model.X[i*p],&model.X[i*p]+p,bi);
+            rss += r*r;
+        }
+        t = bi[model.study_feature]/std::sqrt(rss/(n-p)*cov_study);
+        return true;
+    }
+    bool init_regression(void)
+    {
+        if(model.threshold_type != stat_model::percentage &&
+           model.threshold_type != stat_model::beta &&
+           model.threshold_type != stat_model::t)
+            return false;
+        if(n <= p || model.X.size() != n*p || model.study_feature >= p)
+            return false;
+        // (X'X)^-1 by Gauss-Jordan elimination
+        std::vector<double> A(p*p),inv(p*p);
+        for(unsigned int k = 0;k < p;++k)
+        {
+            for(unsigned int l = 0;l < p;++l)
+            {
+                double sum = 0.0;
+                for(unsigned int i = 0;i < n;++i)
+                    sum += model.X[i*p+k]*model.X[i*p+l];
+                A[k*p+l] = sum;
+            }
+            inv[k*p+k] = 1.0;
+        }
+        for(unsigned int c = 0;c < p;++c)
+        {
+            unsigned int pivot = c;
+            for(unsigned int r = c+1;r < p;++r)
+                if(std::fabs(A[r*p+c]) > std::fabs(A[pivot*p+c]))
+                    pivot = r;
+            if(A[pivot*p+c] == 0.0)
+                return false;
+            if(pivot != c)
+                for(unsigned int l = 0;l < p;++l)
+                {
+                    std::swap(A[c*p+l],A[pivot*p+l]);
+                    std::swap(inv[c*p+l],inv[pivot*p+l]);
+                }
+            double scale = 1.0/A[c*p+c];
+            for(unsigned int l = 0;l < p;++l)
+            {
+                A[c*p+l] *= scale;
+                inv[c*p+l] *= scale;
+            }
+            for(unsigned int r = 0;r < p;++r)
+                if(r != c && A[r*p+c] != 0.0)
+                {
+                    double f = A[r*p+c];
+                    for(unsigned int l = 0;l < p;++l)
+                    {
+                        A[r*p+l] -= f*A[c*p+l];
+                        inv[r*p+l] -= f*inv[c*p+l];
+                    }
+                }
+        }
+        cov_study = inv[model.study_feature*(p+1)];
+        pinv.resize(p*n);
+        for(unsigned int k = 0;k < p;++k)
+            for(unsigned int i = 0;i < n;++i)
+                pinv[k*n+i] = image::vec::dot(&inv[k*p],&inv[k*p]+p,&model.X[i*p]);
+        b.resize(p*stat_model_batch::block_size);
+        cov.swap(inv);
+
+        // the closed form must reproduce mr.regress, otherwise the positions are solved one by one
+        std::vector<double> probe(n),b1(p),b2(p),t2(p);
+        for(unsigned int i = 0;i < n;++i)
+        {
+            probe[i] = std::sin(double(i+1));
+            for(unsigned int k = 0;k < p;++k)
+                probe[i] += model.X[i*p+k]*double(k+1);
+        }
+        double t1 = 0.0;
+        solve(&probe[0],&b1[0],t1);
+        model.mr.regress(&probe[0],&b2[0],&t2[0]);
+        for(unsigned int k = 0;k < p;++k)
+            if(std::fabs(b1[k]-b2[k]) > 1.0e-6*std::max(1.0,std::fabs(b2[k])))
+                return false;
+        if(model.threshold_type == stat_model::t &&
+           std::fabs(t1-t2[model.study_feature]) > 1.0e-6*std::max(1.0,std::fabs(t2[model.study_feature])))
+            return false;
+        return true;
+    }
+private:// statistics as weighted sums over the subjects of a voxel-major row
+    unsigned int subject_count;
+    std::vector<double> weight;// weight_count rows of subject_count
+    unsigned int weight_count;
+    std::vector<double> dots;
+    std::vector<float> row_sd;// normalization of each subject, empty if not normalized
+    void add_weight(unsigned int row,unsigned int sample,double value,const std::vector<float>& sd)
+    {
+        unsigned int subject = model.subject_index[sample];
+        weight[row*subject_count+subject] += sd.empty() ? value : value*sd[subject];
+    }
+public:
+    static const unsigned int block_size = 64;
+    bool supported;
+    bool weighted;
+    // A resampled model differs from the original only by its subject index, so every
+    // statistic that is linear in the population (sums, means, regression coefficients,
+    // X'y) is a dot product of the voxel row with weights collected once per model.
+    // sd holds the normalization of each subject (empty if not normalized).
+    bool init_weighted(unsigned int subject_count_,const std::vector<float>& sd)
+    {
+        subject_count = subject_count_;
+        weighted = false;
+        row_sd.clear();
+        if(!supported)
+            return false;
+        weight_count = 2;
+        switch(model.type)
+        {
+        case 0: // group: wd = group mean difference, ws = average of the group means
+        case 3: // paired: wd = (first - second), ws = (first + second)/2
+            if(model.threshold_type != stat_model::percentage &&
+               model.threshold_type != stat_model::mean_dif)
+                return false;
+            break;
+        case 1: // regression: coefficient of the study feature and the mean, or X'y
+            if(model.threshold_type == stat_model::t)
+                weight_count = p;
+            break;
+        default:
+            return false;
+        }
+        weight.clear();
+        weight.resize(weight_count*subject_count);
+        dots.resize(weight_count);
+        for(unsigned int i = 0;i < n;++i)
+            if(model.subject_index[i] >= subject_count)
+                return false;
+        switch(model.type)
+        {
+        case 0:
+            for(unsigned int i = 0;i < n;++i)
+            {
+                double w = model.label[i] ? -1.0/model.group2_count : 1.0/model.group1_count;
+                add_weight(0,i,w,sd);
+                add_weight(1,i,std::fabs(w)*0.5,sd);
+            }
+            break;
+        case 3:
+            {
+                unsigned int half_size = n >> 1;
+                double scale = model.threshold_type == stat_model::mean_dif ? 1.0/half_size : 1.0;
+                for(unsigned int i = 0;i < n;++i)
+                {
+                    add_weight(0,i,i < half_size ? scale : -scale,sd);
+                    add_weight(1,i,0.5,sd);
+                }
+            }
+            break;
+        case 1:
+            if(model.threshold_type == stat_model::t)
+            {
+                for(unsigned int i = 0;i < n;++i)
+                    for(unsigned int k = 0;k < p;++k)
+                        add_weight(k,i,model.X[i*p+k],sd);
+                row_sd = sd;
+            }
+            else
+                for(unsigned int i = 0;i < n;++i)
+                {
+                    add_weight(0,i,pinv[model.study_feature*n+i],sd);
+                    add_weight(1,i,1.0/n,sd);
+                }
+            break;
+        }
+        weighted = true;
+        if(model.type == 1 && model.threshold_type == stat_model::t)
+        {
+            // the weighted t must reproduce solve, otherwise calculate_spm uses the block path
+            std::vector<float> probe(subject_count);
+            for(unsigned int j = 0;j < subject_count;++j)
+                probe[j] = 1.0f+0.5f*std::sin(float(j+1));
+            std::vector<double> probe_y(n),probe_b(p);
+            for(unsigned int i = 0;i < n;++i)
+                probe_y[i] = sample(&probe[0],i);
+            double t1 = 0.0;
+            solve(&probe_y[0],&probe_b[0],t1);
+            double t2 = (*this)(&probe[0]);
+            if(!(std::fabs(t1-t2) <= 1.0e-6*std::max(1.0,std::fabs(t1))))
+                weighted = false;
+        }
+        return weighted;
+    }
+    double sample(const float* row,unsigned int i) const
+    {
+        unsigned int subject = model.subject_index[i];
+        return row_sd.empty() ? row[subject] : double(row[subject])*row_sd[subject];
+    }
+    double operator()(const float* row)
+    {
+        for(unsigned int r = 0;r < weight_count;++r)
+        {
+            const double* w = &weight[r*subject_count];
+            double sum = 0.0;
+            for(unsigned int j = 0;j < subject_count;++j)
+                sum += w[j]*row[j];
+            dots[r] = sum;
+        }
+        switch(model.type)
+        {
+        case 0: // group
+        case 3: // paired
+            if(model.threshold_type == stat_model::mean_dif)
+                return dots[0];
+            return dots[1] == 0.0 ? 0.0 : dots[0]/dots[1];
+        case 1: // multiple regression
+            if(model.threshold_type == stat_model::beta)
+                return dots[0];
+            if(model.threshold_type == stat_model::percentage)
+                return dots[1] == 0.0 ? 0.0 : dots[0]*model.X_range[model.study_feature]/dots[1];
+            {
+                // b = (X'X)^-1 X'y, and the rss is summed over the residuals: y'y - b'X'y
+                // would cancel catastrophically when the fit explains most of y'y
+                double* bi = &b[0];
+                for(unsigned int k = 0;k < p;++k)
+                    bi[k] = image::vec::dot(&cov[k*p],&cov[k*p]+p,&dots[0]);
+                double rss = 0.0;
+                for(unsigned int i = 0;i < n;++i)
+                {
+                    double r = sample(row,i)-image::vec::dot(&model.X[i*p],&model.X[i*p]+p,bi);
+                    rss += r*r;
+                }
+                return bi[model.study_feature]/std::sqrt(rss/(n-p)*cov_study);
+            }
+        }
+        return 0.0;
+    }
+public:
+    stat_model_batch(const stat_model& model_):model(model_),n(model_.subject_index.size()),p(model_.feature_count),supported(false),weighted(false)
+    {
+        switch(model.type)
+        {
+        case 0: // group
+            if(model.label.size() != n)
+                return;
+            for(unsigned int index = 0;index < n;++index)
+                if(!model.label[index])
+                    order.push_back(model.subject_index[index]);
+            for(unsigned int index = 0;index < n;++index)
+                if(model.label[index])
+                    order.push_back(model.subject_index[index]);
+            supported = true;
+            break;
+        case 1: // multiple regression
+            order = model.subject_index;
+            supported = init_regression();
+            break;
+        case 3: // paired
+            order = model.subject_index;
+            supported = true;
+            break;
+        }
+        y.resize(n*block_size);
+    }
+    // population: count rows of all subjects, stride apart
+    void run(const double* population,unsigned int stride,unsigned int count,double* result)
+    {
+        for(unsigned int j = 0;j < count;++j)
+        {
+            const double* row = population+j*stride;
+            double* yj = &y[j*n];
+            for(unsigned int i = 0;i < n;++i)
+                yj[i] = row[order[i]];
+        }
+        std::fill(result,result+count,0.0);
+        switch(model.type)
+        {
+        case 0: // group
+            for(unsigned int j = 0;j < count;++j)
+            {
+                double* g0 = &y[j*n];
+                double* g1 = g0+model.group1_count;
+                if(model.threshold_type == stat_model::t)
+                {
+                    result[j] = image::t_statistics(g0,g1,g1,g0+n);
+                    continue;
+                }
+                float sum1 = 0.0;
+                float sum2 = 0.0;
+                for(unsigned int index = 0;index < model.group1_count;++index)
+                    sum1 += g0[index];
+                for(unsigned int index = 0;index < model.group2_count;++index)
+                    sum2 += g1[index];
+                float mean1 = sum1/((double)model.group1_count);
+                float mean2 = sum2/((double)model.group2_count);
+                if(model.threshold_type == stat_model::percentage)
+                {
+                    float m = (mean1 + mean2)/2.0;
+                    result[j] = (m == 0.0) ? 0.0 : (mean1 - mean2)/m;
+                }
+                else
+                    if(model.threshold_type == stat_model::mean_dif)
+                        result[j] = mean1-mean2;
+            }
+            break;
+        case 1: // multiple regression
+            {
+                const unsigned int s = model.study_feature;
+                if(model.threshold_type == stat_model::t)
+                {
+                    for(unsigned int j = 0;j < count;++j)
+                        solve(&y[j*n],&b[j*p],result[j]);
+                    break;
+                }
+                // only the coefficient of the study feature is needed
+                std::vector<const double*> yi(count);
+                std::vector<double*> bi(count);
+                for(unsigned int j = 0;j < count;++j)
+                {
+                    yi[j] = &y[j*n];
+                    bi[j] = &b[j*p];
+                }
+                block_vector_product(&pinv[s*n],&yi[0],&bi[0],1,n,count);
+                for(unsigned int j = 0;j < count;++j)
+                {
+                    if(model.threshold_type == stat_model::beta)
+                    {
+                        result[j] = b[j*p];
+                        continue;
+                    }
+                    double mean = image::mean(yi[j],yi[j]+n);
+                    result[j] = mean == 0 ? 0:b[j*p]*model.X_range[s]/mean;
+                }
+            }
+            break;
+        case 3: // paired
+            for(unsigned int j = 0;j < count;++j)
+            {
+                double* yj = &y[j*n];
+                unsigned int half_size = n >> 1;
+                if(model.threshold_type == stat_model::t)
+                {
+                    image::minus(yj,yj+half_size,yj+half_size);
+                    result[j] = image::t_statistics(yj,yj+half_size);
+                    continue;
+                }
+                float g1 = std::accumulate(yj,yj+half_size,0.0);
+                float g2 = std::accumulate(yj+half_size,yj+n,0.0);
+                if(model.threshold_type == stat_model::percentage)
+                    result[j] = 2.0*(g1-g2)/(g1+g2);
+                else
+                    if(model.threshold_type == stat_model::mean_dif)
+                        result[j] = (g1-g2)/half_size;
+            }
+            break;
+        }
+    }
+};
+
 void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,stat_model& info,
-                   float fiber_threshold,bool normalize_qa,bool& terminated)
+                   float fiber_threshold,bool normalize_qa,bool& terminated,float result_threshold)
 {
+    stat_model_batch batch(info);
+    const bool voxel_major = handle->db.build_voxel_qa();
+    if(result_threshold > 0.0f && voxel_major &&
+       batch.init_weighted(handle->db.subject_qa.size(),
+                           normalize_qa ? handle->db.subject_qa_sd : std::vector<float>()))
+    {
+        // only the values reaching the tracking threshold are written, into a result
+        // that holds the db voxels only
+        data.initialize_sparse(handle);
+        const unsigned int stride = handle->db.subject_qa.size();
+        for(unsigned int s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
+        {
+            unsigned int cur_index = handle->db.si2vi[s_index];
+            for(unsigned int fib = 0,fib_offset = 0;fib < handle->dir.num_fiber && handle->dir.fa[fib][cur_index] > fiber_threshold;
+                    ++fib,fib_offset+=handle->db.si2vi.size())
+            {
+                const float* qa = handle->db.get_voxel_qa(s_index + fib_offset);
+                if(std::find(qa,qa+stride,0.0f) != qa+stride)
+                    continue;
+                double value = batch(qa);
+                if(value >= result_threshold) // group 0 > group 1
+                    data.set_greater(fib,s_index,value);
+                if(-value >= result_threshold) // group 0 < group 1
+                    data.set_lesser(fib,s_index,-value);
+            }
+        }
+        return;
+    }
     data.initialize(handle);
-    std::vector<double> population(handle->db.subject_qa.size());
+    const unsigned int stride = handle->db.subject_qa.size();
+    const unsigned int block_size = stat_model_batch::block_size;
+    std::vector<double> population(stride*block_size),single_population;
+    std::vector<double> result(block_size);
+    std::vector<unsigned int> block_fib(block_size),block_index(block_size);
+    unsigned int count = 0;
+    auto assign = [&](unsigned int fib,unsigned int cur_index,double value)
+    {
+        if(value > 0.0) // group 0 > group 1
+            data.greater[fib][cur_index] = value;
+        if(value < 0.0) // group 0 < group 1
+            data.lesser[fib][cur_index] = -value;
+    };
+    auto flush = [&](void)
+    {
+        batch.run(&population[0],stride,count,&result[0]);
+        for(unsigned int j = 0;j < count;++j)
+            assign(block_fib[j],block_index[j],result[j]);
+        count = 0;
+    };
     for(unsigned int s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
     {
         unsigned int cur_index = handle->db.si2vi[s_index];
@@ -542,29 +1258,87 @@ void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,s
                 ++fib,fib_offset+=handle->db.si2vi.size())
         {
             unsigned int pos = s_index + fib_offset;
+            double* row = &population[count*stride];
+            if(voxel_major)
+            {
+                const float* qa = handle->db.get_voxel_qa(pos);
+                if(normalize_qa)
+                    for(unsigned int index = 0;index < stride;++index)
+                        row[index] = qa[index]*handle->db.subject_qa_sd[index];
+                else
+                    std::copy(qa,qa+stride,row);
+            }
+            else
             if(normalize_qa)
-                for(unsigned int index = 0;index < population.size();++index)
-                    population[index] = handle->db.subject_qa[index][pos]*handle->db.subject_qa_sd[index];
+                for(unsigned int index = 0;index < stride;++index)
+                    row[index] = handle->db.subject_qa[index][pos]*handle->db.subject_qa_sd[index];
             else
-                for(unsigned int index = 0;index < population.size();++index)
-                    population[index] = handle->db.subject_qa[index][pos];
+                for(unsigned int index = 0;index < stride;++index)
+                    row[index] = handle->db.subject_qa[index][pos];
 
-            if(std::find(population.begin(),population.end(),0.0) != population.end())
+            if(std::find(row,row+stride,0.0) != row+stride)
                 continue;
-            double result = info(population,pos);
-
-            if(result > 0.0) // group 0 > group 1
-                data.greater[fib][cur_index] = result;
-            if(result < 0.0) // group 0 < group 1
-                data.lesser[fib][cur_index] = -result;
-
+            if(!batch.supported)
+            {
+                single_population.assign(row,row+stride);
+                assign(fib,cur_index,info(single_population,pos));
+                continue;
+            }
+            block_fib[count] = fib;
+            block_index[count] = cur_index;
+            if(++count == block_size)
+                flush();
         }
     }
+    if(count)
+        flush();
 }
 
 
+void connectometry_result::initialize_sparse(std::shared_ptr<fib_data> handle)
+{
+    unsigned char num_fiber = handle->dir.num_fiber;
+    if(sparse && greater.size() == num_fiber && !greater.empty() && greater[0].size() == handle->db.si2vi.size())
+    {
+        for(unsigned int index = 0;index < greater_written.size();++index)
+            greater[greater_written[index].first][greater_written[index].second] = 0.0;
+        for(unsigned int index = 0;index < lesser_written.size();++index)
+            lesser[lesser_written[index].first][lesser_written[index].second] = 0.0;
+        greater_written.clear();
+        lesser_written.clear();
+        return;
+    }
+    greater.clear();
+    lesser.clear();
+    greater.resize(num_fiber,std::vector<float>(handle->db.si2vi.size()));
+    lesser.resize(num_fiber,std::vector<float>(handle->db.si2vi.size()));
+    greater_ptr.resize(num_fiber);
+    lesser_ptr.resize(num_fiber);
+    for(unsigned char fib = 0;fib < num_fiber;++fib)
+    {
+        greater_ptr[fib] = greater[fib].data();
+        lesser_ptr[fib] = lesser[fib].data();
+    }
+    greater_written.clear();
+    lesser_written.clear();
+    sparse = true;
+}
+// seeding voxels of a sparse result, in voxel order as the dense scan in run_track
+void connectometry_result::get_sparse_seeds(std::shared_ptr<fib_data> handle,bool greater_result,float threshold,
+                                            std::vector<unsigned int>& voxels) const
+{
+    const std::vector<std::pair<unsigned char,unsigned int> >& written = greater_result ? greater_written:lesser_written;
+    const std::vector<float>& fa0 = greater_result ? greater[0]:lesser[0];
+    voxels.clear();
+    for(unsigned int index = 0;index < written.size();++index)
+        if(written[index].first == 0 && fa0[written[index].second] > threshold)
+            voxels.push_back(handle->db.si2vi[written[index].second]);
+}
 void connectometry_result::initialize(std::shared_ptr<fib_data> handle)
 {
+    sparse = false;
+    greater_written.clear();
+    lesser_written.clear();
     unsigned char num_fiber = handle->dir.num_fiber;
     greater.resize(num_fiber);
     lesser.resize(num_fiber);
@@ -867,6 +1641,15 @@ void stat_model::remove_missing_data(double missing_value)
 bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
 {
     std::lock_guard<std::mutex> lock(rhs.lock_random);
+    return resample(rhs,null,bootstrap,[&](unsigned int n){return (unsigned int)rhs.rand_gen(n);});
+}
+// draws from the caller's own generator, so no lock is needed
+bool stat_model::resample(const stat_model& rhs,bool null,bool bootstrap,std::mt19937& gen)
+{
+    return resample(rhs,null,bootstrap,[&](unsigned int n){return std::uniform_int_distribution<unsigned int>(0,n-1)(gen);});
+}
+bool stat_model::resample(const stat_model& rhs,bool null,bool bootstrap,const std::function<unsigned int(unsigned int)>& random)
+{
     *this = rhs;
     unsigned int trial = 0;
     do
@@ -891,7 +1674,7 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
             {
                 unsigned int new_index = index;
                 if(bootstrap)
-                    new_index = rhs.label[index] ? group1[rhs.rand_gen(group1.size())]:group0[rhs.rand_gen(group0.size())];
+                    new_index = rhs.label[index] ? group1[random(group1.size())]:group0[random(group0.size())];
                 subject_index[index] = rhs.subject_index[new_index];
                 label[index] = rhs.label[new_index];
             }
@@ -901,7 +1684,7 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
             X.resize(rhs.X.size());
             for(unsigned int index = 0,pos = 0;index < rhs.subject_index.size();++index,pos += feature_count)
             {
-                unsigned int new_index = bootstrap ? rhs.rand_gen(rhs.subject_index.size()) : index;
+                unsigned int new_index = bootstrap ? random(rhs.subject_index.size()) : index;
                 subject_index[index] = rhs.subject_index[new_index];
                 std::copy(rhs.X.begin()+new_index*feature_count,
                           rhs.X.begin()+new_index*feature_count+feature_count,X.begin()+pos);
@@ -911,7 +1694,7 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
         case 2: // individual
             for(unsigned int index = 0;index < rhs.subject_index.size();++index)
             {
-                unsigned int new_index = bootstrap ? rhs.rand_gen(rhs.subject_index.size()) : index;
+                unsigned int new_index = bootstrap ? random(rhs.subject_index.size()) : index;
                 subject_index[index] = rhs.subject_index[new_index];
             }
             break;
@@ -919,16 +1702,16 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
             paired.resize(rhs.subject_index.size());
             for(unsigned int index = 0;index < rhs.subject_index.size();++index)
             {
-                unsigned int new_index = bootstrap ? rhs.rand_gen(rhs.subject_index.size()) : index;
+                unsigned int new_index = bootstrap ? random(rhs.subject_index.size()) : index;
                 subject_index[index] = rhs.subject_index[new_index];
                 paired[index] = rhs.paired[new_index];
-                if(null && rhs.rand_gen(2) == 1)
+                if(null && random(2) == 1)
                     std::swap(subject_index[index],paired[index]);
             }
             break;
         }
         if(null)
-            std::random_shuffle(subject_index.begin(),subject_index.end(),rhs.rand_gen);
+            std::random_shuffle(subject_index.begin(),subject_index.end(),random);
     }while(!pre_process());
 
     return true;
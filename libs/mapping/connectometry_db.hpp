@@ -2,6 +2,9 @@
 #define CONNECTOMETRY_DB_H
 #include <vector>
 #include <string>
+#include <random>
+#include <functional>
+#include <mutex>
 #include "gzip_interface.hpp"
 #include "image/image.hpp"
 class fib_data;
@@ -19,18 +22,35 @@ public:
     image::basic_image<unsigned int,3> vi2si;
     std::vector<unsigned int> si2vi;
     std::vector<std::vector<float> > subject_qa_buf;// merged from other db
+private:// voxel-major copy: the values of all subjects at a fiber position are contiguous and 64-byte aligned
+    std::vector<float> voxel_qa_buf;
+    const float* voxel_qa;
+    unsigned int voxel_qa_stride;
+    std::mutex voxel_qa_lock;
 public:
-    connectometry_db():num_subjects(0){;}
+    // the copy doubles the memory of the subject data, so it is only built by the first analysis
+    bool build_voxel_qa(void);
+    void clear_voxel_qa(void);
+    // valid after build_voxel_qa returns true
+    const float* get_voxel_qa(unsigned int pos) const{return voxel_qa+size_t(pos)*voxel_qa_stride;}
+public:
+    connectometry_db():num_subjects(0),voxel_qa(0),voxel_qa_stride(0){;}
     bool has_db(void)const{return num_subjects > 0;}
     void read_db(fib_data* handle);
     void remove_subject(unsigned int index);
     void calculate_si2vi(void);
-    bool sample_odf(gz_mat_read& m,std::vector<float>& data);
-    bool sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name);
+    bool sample_odf(gz_mat_read& m,std::vector<float>& data) const;
+    bool sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name) const;
     bool is_consistent(gz_mat_read& m);
-    bool load_subject_files(const std::vector<std::string>& file_names,
+    bool is_consistent(gz_mat_read& m,std::string& error_msg) const;
+    bool load_subject_file(const std::string& file_name,const char* index_name,
+                           std::vector<float>& data,float& r2,std::string& report,std::string& error_msg) const;
+    bool save_subject_files(const std::vector<std::string>& file_names,
+                            const std::vector<std::string>& subject_names_,
+                            const char* index_name,const char* output_name,unsigned int thread_count);
+    bool write_subject_files(gz_mat_write& matfile,const std::vector<std::string>& file_names,
                             const std::vector<std::string>& subject_names_,
-                            const char* index_name);
+                            const char* index_name,unsigned int thread_count);
     void get_subject_vector(std::vector<std::vector<float> >& subject_vector,
                             const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const;
     void get_subject_vector(unsigned int subject_index,std::vector<float>& subject_vector,
@@ -83,6 +103,8 @@ public:
     void remove_subject(unsigned int index);
     void remove_missing_data(double missing_value);
     bool resample(stat_model& rhs,bool null,bool bootstrap);
+    bool resample(const stat_model& rhs,bool null,bool bootstrap,std::mt19937& gen);
+    bool resample(const stat_model& rhs,bool null,bool bootstrap,const std::function<unsigned int(unsigned int)>& random);
     bool pre_process(void);
     void select(const std::vector<double>& population,std::vector<double>& selected_population)const;
     double operator()(const std::vector<double>& population,unsigned int pos) const;
@@ -117,6 +139,26 @@ public:
 struct connectometry_result{
     std::vector<std::vector<float> > greater,lesser;
     std::vector<const float*> greater_ptr,lesser_ptr;
+private:// sparse results hold the db voxels only (slot = index in db.si2vi), and the
+        // written slots are cleared at the next initialize_sparse
+    bool sparse = false;
+    std::vector<std::pair<unsigned char,unsigned int> > greater_written,lesser_written;
+public:
+    bool is_sparse(void) const{return sparse;}
+    void initialize_sparse(std::shared_ptr<fib_data> handle);
+    void set_greater(unsigned char fib,unsigned int slot,float value)
+    {
+        greater[fib][slot] = value;
+        greater_written.push_back(std::make_pair(fib,slot));
+    }
+    void set_lesser(unsigned char fib,unsigned int slot,float value)
+    {
+        lesser[fib][slot] = value;
+        lesser_written.push_back(std::make_pair(fib,slot));
+    }
+    void get_sparse_seeds(std::shared_ptr<fib_data> handle,bool greater_result,float threshold,
+                          std::vector<unsigned int>& voxels) const;
+public:
     void remove_old_index(std::shared_ptr<fib_data> handle);
     bool compare(std::shared_ptr<fib_data> handle,
                  const std::vector<const float*>& fa1,const std::vector<const float*>& fa2,
@@ -133,7 +175,7 @@ public:
 };
 
 void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,stat_model& info,
-                   float fiber_threshold,bool normalize_qa,bool& terminated);
+                   float fiber_threshold,bool normalize_qa,bool& terminated,float result_threshold = 0.0f);
 
 
 #endif // CONNECTOMETRY_DB_H
@@ -0,0 +1,385 @@
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "mmap_mat.hpp"
+#include "gzip_interface.hpp"
+
+const char mmap_mat_magic[8] = {'D','S','I','M','A','T','1',0};
+const unsigned int mmap_mat_version = 1;
+const uint64_t mmap_mat_page_size = 4096;
+const uint64_t mmap_mat_header_size = 32;
+
+unsigned int mmap_mat_element_size(unsigned int type)
+{
+    switch((type/10)%10)
+    {
+    case 0:
+        return 8;
+    case 1:
+    case 2:
+        return 4;
+    case 3:
+    case 4:
+        return 2;
+    case 5:
+        return 1;
+    }
+    return 0;
+}
+
+template<class from_type,class to_type>
+void convert_matrix(const char* from,char* to,size_t count)
+{
+    std::copy((const from_type*)from,(const from_type*)from+count,(to_type*)to);
+}
+template<class from_type>
+void convert_matrix(const char* from,char* to,size_t count,unsigned int to_type)
+{
+    switch(to_type)
+    {
+    case 0:
+        convert_matrix<from_type,double>(from,to,count);
+        break;
+    case 1:
+        convert_matrix<from_type,float>(from,to,count);
+        break;
+    case 2:
+        convert_matrix<from_type,int>(from,to,count);
+        break;
+    case 3:
+        convert_matrix<from_type,short>(from,to,count);
+        break;
+    case 4:
+        convert_matrix<from_type,unsigned short>(from,to,count);
+        break;
+    case 5:
+        convert_matrix<from_type,unsigned char>(from,to,count);
+        break;
+    }
+}
+
+mmap_mat_read::mmap_mat_read(void):base(0),file_size(0)
+{
+#ifdef WIN32
+    file_handle = 0;
+    map_handle = 0;
+#endif
+}
+
+bool mmap_mat_read::is_mmap_mat(const char* file_name)
+{
+    char magic[8] = {0};
+    std::ifstream in(file_name,std::ios::binary);
+    if(!in || !in.read(magic,8))
+        return false;
+    return std::equal(magic,magic+8,mmap_mat_magic);
+}
+
+bool mmap_mat_read::load_from_file(const char* file_name)
+{
+    close();
+#ifdef WIN32
+    HANDLE file = CreateFileA(file_name,GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file,&size) || !size.QuadPart)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMapping(file,0,PAGE_WRITECOPY,0,0,0);
+    if(!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    base = (const char*)MapViewOfFile(mapping,FILE_MAP_COPY,0,0,0);
+    if(!base)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle = file;
+    map_handle = mapping;
+    file_size = size.QuadPart;
+#else
+    int fd = ::open(file_name,O_RDONLY);
+    if(fd == -1)
+        return false;
+    struct stat st;
+    if(fstat(fd,&st) != 0 || !st.st_size)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* ptr = mmap(0,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    ::close(fd);
+    if(ptr == MAP_FAILED)
+        return false;
+    base = (const char*)ptr;
+    file_size = st.st_size;
+#endif
+
+    // parse header and directory
+    unsigned int version = 0,count = 0;
+    uint64_t dir_offset = 0,dir_size = 0;
+    if(file_size < mmap_mat_header_size || !std::equal(base,base+8,mmap_mat_magic))
+    {
+        close();
+        return false;
+    }
+    std::memcpy(&version,base+8,4);
+    std::memcpy(&count,base+12,4);
+    std::memcpy(&dir_offset,base+16,8);
+    std::memcpy(&dir_size,base+24,8);
+    if(version != mmap_mat_version || dir_offset > file_size || dir_size > file_size-dir_offset)
+    {
+        close();
+        return false;
+    }
+    const char* dir = base+dir_offset;
+    const char* dir_end = dir+dir_size;
+    info.resize(count);
+    for(unsigned int index = 0;index < count;++index)
+    {
+        unsigned int value[5];
+        uint64_t value64[3];
+        if(dir + sizeof(value) + sizeof(value64) > dir_end)
+        {
+            close();
+            return false;
+        }
+        std::memcpy(value,dir,sizeof(value));
+        dir += sizeof(value);
+        std::memcpy(value64,dir,sizeof(value64));
+        dir += sizeof(value64);
+        if(dir + value[4] > dir_end ||
+           value64[0] > file_size || value64[1] > file_size-value64[0] ||
+           !mmap_mat_element_size(value[0]) ||
+           value64[2] != (uint64_t)value[1]*value[2]*mmap_mat_element_size(value[0]))
+        {
+            close();
+            return false;
+        }
+        info[index].type = value[0];
+        info[index].rows = value[1];
+        info[index].cols = value[2];
+        info[index].compressed = value[3];
+        info[index].name = std::string(dir,dir+value[4]);
+        info[index].offset = value64[0];
+        info[index].stored_size = value64[1];
+        info[index].raw_size = value64[2];
+        dir += value[4];
+        name_table[info[index].name] = index;
+    }
+    inflated.resize(count);
+    converted.resize(count);
+    return true;
+}
+
+void mmap_mat_read::close(void)
+{
+    if(base)
+    {
+#ifdef WIN32
+        UnmapViewOfFile(base);
+        CloseHandle(map_handle);
+        CloseHandle(file_handle);
+        map_handle = 0;
+        file_handle = 0;
+#else
+        munmap((void*)base,file_size);
+#endif
+    }
+    base = 0;
+    file_size = 0;
+    info.clear();
+    name_table.clear();
+    inflated.clear();
+    converted.clear();
+}
+
+const char* mmap_mat_read::get_raw(unsigned int index) const
+{
+    if(!info[index].compressed)
+        return base+info[index].offset;
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<char>& buf = inflated[index];
+    if(buf.empty() && info[index].raw_size)
+    {
+        uLongf raw_size = info[index].raw_size;
+        buf.resize(raw_size);
+        if(uncompress((Bytef*)&buf[0],&raw_size,(const Bytef*)base+info[index].offset,info[index].stored_size) != Z_OK ||
+           raw_size != info[index].raw_size)
+        {
+            buf.clear();
+            return 0;
+        }
+    }
+    return buf.empty() ? 0:&buf[0];
+}
+
+const void* mmap_mat_read::get_data(unsigned int index,unsigned int type) const
+{
+    const char* raw = get_raw(index);
+    unsigned int from_type = (info[index].type/10)%10;
+    unsigned int to_type = (type/10)%10;
+    size_t count = (size_t)info[index].rows*info[index].cols;
+    if(!raw || from_type == to_type || !count)
+        return raw;
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<char>& buf = converted[index][to_type];
+    if(buf.empty())
+    {
+        buf.resize(count*mmap_mat_element_size(type));
+        switch(from_type)
+        {
+        case 0:
+            convert_matrix<double>(raw,&buf[0],count,to_type);
+            break;
+        case 1:
+            convert_matrix<float>(raw,&buf[0],count,to_type);
+            break;
+        case 2:
+            convert_matrix<int>(raw,&buf[0],count,to_type);
+            break;
+        case 3:
+            convert_matrix<short>(raw,&buf[0],count,to_type);
+            break;
+        case 4:
+            convert_matrix<unsigned short>(raw,&buf[0],count,to_type);
+            break;
+        case 5:
+            convert_matrix<unsigned char>(raw,&buf[0],count,to_type);
+            break;
+        }
+    }
+    return &buf[0];
+}
+
+mmap_mat_write::mmap_mat_write(const char* file_name,bool compress_):
+    out(file_name,std::ios::binary),compress(compress_),failed(false)
+{
+    // header is written at close()
+    std::vector<char> header(mmap_mat_header_size);
+    out.write(&header[0],header.size());
+}
+
+bool mmap_mat_write::write_raw(const char* name,unsigned int type,unsigned int rows,unsigned int cols,const void* buf)
+{
+    if(!out || !mmap_mat_element_size(type))
+        return false;
+    matrix_info new_info;
+    new_info.name = name;
+    new_info.type = type;
+    new_info.rows = rows;
+    new_info.cols = cols;
+    new_info.compressed = false;
+    new_info.raw_size = (uint64_t)rows*cols*mmap_mat_element_size(type);
+    new_info.stored_size = new_info.raw_size;
+
+    // pad to the next page
+    uint64_t pos = out.tellp();
+    new_info.offset = (pos+mmap_mat_page_size-1)/mmap_mat_page_size*mmap_mat_page_size;
+    if(new_info.offset != pos)
+    {
+        std::vector<char> padding(new_info.offset-pos);
+        out.write(&padding[0],padding.size());
+    }
+
+    std::vector<Bytef> compressed_buf;
+    if(compress && new_info.raw_size > mmap_mat_page_size && new_info.raw_size < 0x7FFFFFFF)
+    {
+        uLongf compressed_size = compressBound(new_info.raw_size);
+        compressed_buf.resize(compressed_size);
+        if(compress2(&compressed_buf[0],&compressed_size,(const Bytef*)buf,new_info.raw_size,Z_DEFAULT_COMPRESSION) == Z_OK &&
+           compressed_size < new_info.raw_size)
+        {
+            new_info.compressed = true;
+            new_info.stored_size = compressed_size;
+        }
+    }
+    if(new_info.compressed)
+        out.write((const char*)&compressed_buf[0],new_info.stored_size);
+    else
+        if(new_info.raw_size)
+            out.write((const char*)buf,new_info.raw_size);
+    info.push_back(new_info);
+    return out.good();
+}
+
+bool mmap_mat_write::close(void)
+{
+    if(!out.is_open())
+        return !failed;
+    if(failed)
+    {
+        out.close();
+        return false;
+    }
+    uint64_t dir_offset = out.tellp();
+    for(unsigned int index = 0;index < info.size();++index)
+    {
+        unsigned int value[5] = {info[index].type,info[index].rows,info[index].cols,
+                                 info[index].compressed ? 1u:0u,(unsigned int)info[index].name.length()};
+        uint64_t value64[3] = {info[index].offset,info[index].stored_size,info[index].raw_size};
+        out.write((const char*)value,sizeof(value));
+        out.write((const char*)value64,sizeof(value64));
+        out.write(info[index].name.c_str(),info[index].name.length());
+    }
+    uint64_t dir_size = (uint64_t)out.tellp()-dir_offset;
+    unsigned int count = info.size();
+    out.seekp(0,std::ios::beg);
+    out.write(mmap_mat_magic,8);
+    out.write((const char*)&mmap_mat_version,4);
+    out.write((const char*)&count,4);
+    out.write((const char*)&dir_offset,8);
+    out.write((const char*)&dir_size,8);
+    bool result = out.good();
+    out.close();
+    return result;
+}
+
+bool convert_to_mmap_mat(const char* from,const char* to,bool compress)
+{
+    gz_mat_stream in;
+    if(!in.open(from))
+        return false;
+    mmap_mat_write out(to,compress);
+    auto fail = [&](void)->bool
+    {
+        out.abort();
+        std::remove(to);
+        return false;
+    };
+    if(!out)
+        return fail();
+    unsigned int count = 0;
+    // only the end of the file exactly at a matrix boundary is a complete conversion
+    while(!in.at_end())
+    {
+        if(!in.next() ||
+           !out.write_raw(in.name.c_str(),in.type,in.rows,in.cols,in.data.empty() ? 0:&in.data[0]))
+            return fail();
+        ++count;
+    }
+    if(!count || prog_aborted())
+        return fail();
+    if(!out.close())
+    {
+        std::remove(to);
+        return false;
+    }
+    return true;
+}
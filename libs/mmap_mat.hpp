@@ -0,0 +1,154 @@
+#ifndef MMAP_MAT_HPP
+#define MMAP_MAT_HPP
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <stdint.h>
+
+/*
+ Memory-mapped matrix container. It keeps the named-matrix semantics of the
+ .fib.gz/.src.gz files, but each matrix is stored at a page-aligned offset so
+ that read() returns a pointer into the mapping and only the accessed pages are
+ loaded. A matrix may be stored zlib-compressed, in which case it is inflated
+ on its first access. The file is mapped copy-on-write: callers that modify a
+ matrix in place (e.g. flipping or rotating the DWI) get private copies of the
+ touched pages, and the file itself is never changed.
+
+ layout:
+ [0,32)     "DSIMAT1" magic, version, matrix count, directory offset and size
+ [4096,...) page-aligned matrix payloads
+ directory  type,rows,cols,compressed,name length,offset,stored size,raw size,name
+*/
+
+// matrix type code of the MATLAB v4 format used by the fib/src files
+template<class T> struct mmap_mat_type;
+template<> struct mmap_mat_type<double>{static const unsigned int value = 0;};
+template<> struct mmap_mat_type<float>{static const unsigned int value = 10;};
+template<> struct mmap_mat_type<int>{static const unsigned int value = 20;};
+template<> struct mmap_mat_type<unsigned int>{static const unsigned int value = 20;};
+template<> struct mmap_mat_type<short>{static const unsigned int value = 30;};
+template<> struct mmap_mat_type<unsigned short>{static const unsigned int value = 40;};
+template<> struct mmap_mat_type<unsigned char>{static const unsigned int value = 50;};
+template<> struct mmap_mat_type<char>{static const unsigned int value = 50;};
+
+unsigned int mmap_mat_element_size(unsigned int type);
+
+// write raw matrix data of the given type code through a typed mat writer
+template<class writer_type>
+void mmap_mat_write_to(writer_type& writer,const char* name,unsigned int type,
+                       unsigned int rows,unsigned int cols,const void* data)
+{
+    switch((type/10)%10)
+    {
+    case 0:
+        writer.write(name,(const double*)data,rows,cols);
+        break;
+    case 1:
+        writer.write(name,(const float*)data,rows,cols);
+        break;
+    case 2:
+        writer.write(name,(const int*)data,rows,cols);
+        break;
+    case 3:
+        writer.write(name,(const short*)data,rows,cols);
+        break;
+    case 4:
+        writer.write(name,(const unsigned short*)data,rows,cols);
+        break;
+    case 5:
+        writer.write(name,(const unsigned char*)data,rows,cols);
+        break;
+    }
+}
+
+class mmap_mat_read{
+    struct matrix_info{
+        std::string name;
+        unsigned int type,rows,cols;
+        bool compressed;
+        uint64_t offset,stored_size,raw_size;
+    };
+    std::vector<matrix_info> info;
+    std::map<std::string,unsigned int> name_table;
+private:
+    const char* base;
+    uint64_t file_size;
+#ifdef WIN32
+    void* file_handle;
+    void* map_handle;
+#endif
+private:// inflated and type-converted matrices, created on first access
+    mutable std::mutex lock;
+    mutable std::vector<std::vector<char> > inflated;
+    mutable std::vector<std::map<unsigned int,std::vector<char> > > converted;
+    const char* get_raw(unsigned int index) const;
+    const void* get_data(unsigned int index,unsigned int type) const;
+public:
+    mmap_mat_read(void);
+    ~mmap_mat_read(void){close();}
+    static bool is_mmap_mat(const char* file_name);
+    bool load_from_file(const char* file_name);
+    void close(void);
+public:
+    unsigned int size(void) const{return info.size();}
+    std::string name(unsigned int index) const{return info[index].name;}
+    template<class data_type>
+    bool read(unsigned int index,unsigned int& rows,unsigned int& cols,const data_type*& out) const
+    {
+        if(index >= info.size())
+            return false;
+        rows = info[index].rows;
+        cols = info[index].cols;
+        out = (const data_type*)get_data(index,mmap_mat_type<data_type>::value);
+        return out;
+    }
+    template<class data_type>
+    bool read(const char* name,unsigned int& rows,unsigned int& cols,const data_type*& out) const
+    {
+        std::map<std::string,unsigned int>::const_iterator iter = name_table.find(name);
+        if(iter == name_table.end())
+            return false;
+        return read(iter->second,rows,cols,out);
+    }
+    // copy one matrix to a mat writer using its stored type
+    template<class writer_type>
+    void write_to(writer_type& writer,unsigned int index) const
+    {
+        unsigned int type = (info[index].type/10)%10*10;
+        mmap_mat_write_to(writer,info[index].name.c_str(),type,info[index].rows,info[index].cols,get_data(index,type));
+    }
+};
+
+class mmap_mat_write{
+    struct matrix_info{
+        std::string name;
+        unsigned int type,rows,cols;
+        bool compressed;
+        uint64_t offset,stored_size,raw_size;
+    };
+    std::vector<matrix_info> info;
+    std::ofstream out;
+    bool compress;
+    bool failed;
+public:
+    mmap_mat_write(const char* file_name,bool compress_ = false);
+    ~mmap_mat_write(void){close();}
+    bool write_raw(const char* name,unsigned int type,unsigned int rows,unsigned int cols,const void* buf);
+    template<class data_type>
+    bool write(const char* name,const data_type* buf,unsigned int rows,unsigned int cols)
+    {
+        return write_raw(name,mmap_mat_type<data_type>::value,rows,cols,buf);
+    }
+    bool close(void);
+    // stop writing without the directory, so the file does not open as a valid container
+    void abort(void){failed = true;close();}
+    operator bool() const	{return out.good();}
+    bool operator!() const	{return !out.good();}
+};
+
+// convert a .fib.gz/.src.gz (or uncompressed .fib/.src) file to the memory-mapped container
+bool convert_to_mmap_mat(const char* from,const char* to,bool compress);
+
+#endif//MMAP_MAT_HPP
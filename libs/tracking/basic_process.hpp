@@ -46,7 +46,7 @@ public:
         {
             for (char j = 0;j < info.trk.fib_num;++j)
             {
-                float fa_value = info.trk.fa[j][next_voxels_index[i]];
+                float fa_value = info.trk.get_fa(next_voxels_index[i],j);
                 if (fa_value <= info.trk.threshold)
                     break;
                 float value = std::abs(info.trk.cos_angle(next_voxels_dir[i],next_voxels_index[i],j));
@@ -0,0 +1,324 @@
+#ifndef BATCH_TRACKING_HPP
+#define BATCH_TRACKING_HPP
+#include <cmath>
+#include <deque>
+#include <vector>
+#include "image/image.hpp"
+#include "tracking_method.hpp"
+#include "roi.hpp"
+#include "fib_data.hpp"
+
+/*
+ Streamline (Euler) tracking that advances batch_size tracks in lockstep.
+ Positions and directions are kept in structure-of-arrays form so that the
+ trilinear weights, the weighted direction sum, the smoothing and the move
+ are computed for all lanes in one loop. A lane that finishes its track is
+ refilled with the next seed. Termination, ROI and smoothing rules are the
+ same as TrackingMethod::start_tracking<streamline_method_process>.
+ Only trilinear interpolation is implemented, and the fiber records have to
+ be packed (see tracking::pack).
+ */
+class BatchTracking{
+public:
+    static const unsigned int batch_size = 8;
+private:
+    const tracking& trk;
+    const RoiMgr& roi_mgr;
+    const TrackingParam& param;
+    int corner_offset[8];
+    std::vector<float> empty_record;
+private:// seeds waiting for a lane
+    std::deque<std::pair<image::vector<3,float>,image::vector<3,float> > > seeds;
+    unsigned int seed_serial;
+private:// lane states
+    float x[batch_size],y[batch_size],z[batch_size];   // position
+    float dx[batch_size],dy[batch_size],dz[batch_size];// direction
+    bool step_ok[batch_size];
+    struct lane_type{
+        bool active;
+        bool forward;
+        unsigned int serial;
+        unsigned int labels;
+        image::vector<3,float> seed_pos,begin_dir,end_point1;
+        std::vector<float> track_buffer;
+        unsigned int buffer_front_pos,buffer_back_pos;
+    } lane[batch_size];
+    unsigned int size(const lane_type& l) const{return l.buffer_back_pos-l.buffer_front_pos;}
+private:
+    // EstimateNextDirection (trilinear), SmoothDir and MoveTrack for all lanes
+    void step(void)
+    {
+        const int dim0 = trk.dim[0],dim1 = trk.dim[1],dim2 = trk.dim[2];
+        bool valid[batch_size];
+        int base[batch_size];
+        float w[8][batch_size];
+        for(unsigned int l = 0;l < batch_size;++l)
+        {
+            float fx = std::floor(x[l]),fy = std::floor(y[l]),fz = std::floor(z[l]);
+            int ix = fx,iy = fy,iz = fz;
+            valid[l] = lane[l].active && x[l] >= 0.0f && y[l] >= 0.0f && z[l] >= 0.0f &&
+                       ix+1 < dim0 && iy+1 < dim1 && iz+1 < dim2;
+            base[l] = valid[l] ? (iz*dim1+iy)*dim0+ix : 0;
+            float px = x[l]-fx,py = y[l]-fy,pz = z[l]-fz;
+            float nx = 1.0f-px,ny = 1.0f-py,nz = 1.0f-pz;
+            w[0][l] = nx*ny*nz;
+            w[1][l] = px*ny*nz;
+            w[2][l] = nx*py*nz;
+            w[3][l] = px*py*nz;
+            w[4][l] = nx*ny*pz;
+            w[5][l] = px*ny*pz;
+            w[6][l] = nx*py*pz;
+            w[7][l] = px*py*pz;
+        }
+        float sx[batch_size] = {0},sy[batch_size] = {0},sz[batch_size] = {0},total_w[batch_size] = {0};
+        for(unsigned int c = 0;c < 8;++c)
+        {
+            // tracking::get_nearest_dir_fib + get_dir on the packed records, written as
+            // selects over the lanes so that the fiber loop has no per-lane branches.
+            // Voxels without a record have no fiber (fa[0] <= 0), same as empty_record.
+            const float* record[batch_size];
+            for(unsigned int l = 0;l < batch_size;++l)
+            {
+                const float* r = valid[l] ? trk.get_record(base[l]+corner_offset[c]) : 0;
+                record[l] = r ? r : &empty_record[0];
+            }
+            float max_value[batch_size],ox[batch_size] = {0},oy[batch_size] = {0},oz[batch_size] = {0};
+            bool found[batch_size] = {false};
+            std::fill(max_value,max_value+batch_size,trk.cull_cos_angle);
+            for(unsigned int fib = 0;fib < trk.fib_num;++fib)
+                for(unsigned int l = 0;l < batch_size;++l)
+                {
+                    const float* f = record[l] + (fib << 2);
+                    float value = dx[l]*f[1] + dy[l]*f[2] + dz[l]*f[3];
+                    bool has_fib = record[l][0] > trk.threshold && f[0] > trk.threshold;
+                    bool reverse = has_fib && -value > max_value[l];
+                    bool take = reverse || (has_fib && value > max_value[l]);
+                    float sign = reverse ? -1.0f : 1.0f;
+                    max_value[l] = take ? sign*value : max_value[l];
+                    ox[l] = take ? sign*f[1] : ox[l];
+                    oy[l] = take ? sign*f[2] : oy[l];
+                    oz[l] = take ? sign*f[3] : oz[l];
+                    found[l] = found[l] || take;
+                }
+            for(unsigned int l = 0;l < batch_size;++l)
+            {
+                float weight = found[l] ? w[c][l] : 0.0f;
+                sx[l] += ox[l]*weight;
+                sy[l] += oy[l]*weight;
+                sz[l] += oz[l]*weight;
+                total_w[l] += weight;
+            }
+        }
+        for(unsigned int l = 0;l < batch_size;++l)
+        {
+            step_ok[l] = valid[l] && total_w[l] >= 0.5f;
+            float r = std::sqrt(sx[l]*sx[l]+sy[l]*sy[l]+sz[l]*sz[l]);
+            if(r != 0.0f)
+            {
+                sx[l] /= r;
+                sy[l] /= r;
+                sz[l] /= r;
+            }
+            // smoothing
+            sx[l] += (dx[l]-sx[l])*param.smooth_fraction;
+            sy[l] += (dy[l]-sy[l])*param.smooth_fraction;
+            sz[l] += (dz[l]-sz[l])*param.smooth_fraction;
+            r = std::sqrt(sx[l]*sx[l]+sy[l]*sy[l]+sz[l]*sz[l]);
+            if(r != 0.0f)
+            {
+                sx[l] /= r;
+                sy[l] /= r;
+                sz[l] /= r;
+            }
+            if(!step_ok[l])
+                continue;
+            x[l] += sx[l]*param.step_size_in_voxel[0];
+            y[l] += sy[l]*param.step_size_in_voxel[1];
+            z[l] += sz[l]*param.step_size_in_voxel[2];
+            dx[l] = sx[l];
+            dy[l] = sy[l];
+            dz[l] = sz[l];
+        }
+    }
+private:
+    image::vector<3,float> position(unsigned int l) const
+    {
+        return image::vector<3,float>(x[l],y[l],z[l]);
+    }
+    void start_backward(unsigned int l)
+    {
+        lane_type& cur = lane[l];
+        cur.forward = false;
+        cur.end_point1 = position(l);
+        x[l] = cur.seed_pos[0];
+        y[l] = cur.seed_pos[1];
+        z[l] = cur.seed_pos[2];
+        dx[l] = -cur.begin_dir[0];
+        dy[l] = -cur.begin_dir[1];
+        dz[l] = -cur.begin_dir[2];
+    }
+    void finish(unsigned int l,bool accepted,std::vector<std::vector<float> >& results)
+    {
+        lane_type& cur = lane[l];
+        cur.active = false;
+        if(!accepted || !size(cur) || size(cur) < param.min_points_count3)
+            return;
+        const float* track = &cur.track_buffer[cur.buffer_front_pos];
+        std::vector<float>& result = results[cur.serial];
+        result.assign(track,track+size(cur));
+        // same orientation as TrackingMethod::get_result
+        image::vector<3,float> tail(&result[result.size()-3]);
+        tail -= image::vector<3,float>(&result[0]);
+        image::vector<3,float> abs_dis(std::abs(tail[0]),std::abs(tail[1]),std::abs(tail[2]));
+        if((abs_dis[0] > abs_dis[1] && abs_dis[0] > abs_dis[2] && tail[0] < 0) ||
+           (abs_dis[1] > abs_dis[0] && abs_dis[1] > abs_dis[2] && tail[1] < 0) ||
+           (abs_dis[2] > abs_dis[1] && abs_dis[2] > abs_dis[0] && tail[2] < 0))
+            for(unsigned int i = 0,j = result.size()-3;i < j;i += 3,j -= 3)
+                for(unsigned int k = 0;k < 3;++k)
+                    std::swap(result[i+k],result[j+k]);
+        if(!roi_mgr.have_include(cur.labels,&result[0],result.size()) ||
+           !roi_mgr.fulfill_end_point(position(l),cur.end_point1))
+            result.clear();
+    }
+    void fill(unsigned int l)
+    {
+        lane_type& cur = lane[l];
+        cur.active = !seeds.empty();
+        if(!cur.active)
+            return;
+        cur.serial = seed_serial++;
+        cur.forward = true;
+        cur.labels = 0;
+        cur.seed_pos = seeds.front().first;
+        cur.begin_dir = seeds.front().second;
+        seeds.pop_front();
+        cur.buffer_front_pos = cur.buffer_back_pos = param.max_points_count3;
+        x[l] = cur.seed_pos[0];
+        y[l] = cur.seed_pos[1];
+        z[l] = cur.seed_pos[2];
+        dx[l] = cur.begin_dir[0];
+        dy[l] = cur.begin_dir[1];
+        dz[l] = cur.begin_dir[2];
+    }
+    // the checks done before a step in the forward loop of start_tracking
+    void before_step(unsigned int l,std::vector<std::vector<float> >& results)
+    {
+        lane_type& cur = lane[l];
+        if(!cur.active || !cur.forward)
+            return;
+        image::vector<3,float> pos(position(l));
+        if(size(cur) > param.max_points_count3 || cur.buffer_back_pos + 3 >= cur.track_buffer.size())
+        {
+            finish(l,false,results);
+            return;
+        }
+        unsigned int label = roi_mgr.get_label(pos);
+        if(label & RoiMgr::exclusive_label)
+        {
+            finish(l,false,results);
+            return;
+        }
+        cur.track_buffer[cur.buffer_back_pos] = pos[0];
+        cur.track_buffer[cur.buffer_back_pos+1] = pos[1];
+        cur.track_buffer[cur.buffer_back_pos+2] = pos[2];
+        cur.buffer_back_pos += 3;
+        cur.labels |= label;
+        if(label & RoiMgr::terminate_label)
+            start_backward(l);
+    }
+    // the checks done after a step in start_tracking
+    void after_step(unsigned int l,std::vector<std::vector<float> >& results)
+    {
+        lane_type& cur = lane[l];
+        if(!cur.active)
+            return;
+        if(cur.forward)
+        {
+            if(!step_ok[l])
+                start_backward(l);
+            return;
+        }
+        if(size(cur) > param.max_points_count3 || cur.buffer_front_pos < 3)
+        {
+            finish(l,false,results);
+            return;
+        }
+        if(!step_ok[l])
+        {
+            finish(l,true,results);
+            return;
+        }
+        image::vector<3,float> pos(position(l));
+        cur.buffer_front_pos -= 3;
+        unsigned int label = roi_mgr.get_label(pos);
+        if(label & RoiMgr::exclusive_label)
+        {
+            finish(l,false,results);
+            return;
+        }
+        cur.track_buffer[cur.buffer_front_pos] = pos[0];
+        cur.track_buffer[cur.buffer_front_pos+1] = pos[1];
+        cur.track_buffer[cur.buffer_front_pos+2] = pos[2];
+        cur.labels |= label;
+        if(label & RoiMgr::terminate_label)
+            finish(l,true,results);
+    }
+public:
+    BatchTracking(const tracking& trk_,const RoiMgr& roi_mgr_,const TrackingParam& param_):
+        trk(trk_),roi_mgr(roi_mgr_),param(param_),seed_serial(0)
+    {
+        empty_record.resize(trk.fib_num << 2);
+        for(unsigned int c = 0;c < 8;++c)
+            corner_offset[c] = (c & 1) + ((c & 2) ? trk.dim[0]:0) + ((c & 4) ? trk.dim.plane_size():0);
+        for(unsigned int l = 0;l < batch_size;++l)
+        {
+            lane[l].active = false;
+            lane[l].track_buffer.resize(param.max_points_count3 << 1);
+            x[l] = y[l] = z[l] = dx[l] = dy[l] = dz[l] = 0.0f;
+        }
+    }
+    void add_seed(const image::vector<3,float>& position,const image::vector<3,float>& dir)
+    {
+        seeds.push_back(std::make_pair(position,dir));
+    }
+    // track all added seeds, the tracts are appended in the order of the seeds
+    void run(std::vector<std::vector<float> >& tracts)
+    {
+        std::vector<std::vector<float> > results(seeds.size());
+        seed_serial = 0;
+        for(unsigned int l = 0;l < batch_size;++l)
+            fill(l);
+        while(true)
+        {
+            bool has_active = false;
+            for(unsigned int l = 0;l < batch_size;++l)
+            {
+                before_step(l,results);
+                // a lane rejected before its step takes the next seed
+                while(!lane[l].active && !seeds.empty())
+                {
+                    fill(l);
+                    before_step(l,results);
+                }
+                has_active |= lane[l].active;
+            }
+            if(!has_active)
+                break;
+            step();
+            for(unsigned int l = 0;l < batch_size;++l)
+            {
+                after_step(l,results);
+                if(!lane[l].active)
+                    fill(l);
+            }
+        }
+        for(unsigned int index = 0;index < results.size();++index)
+            if(!results[index].empty())
+            {
+                tracts.push_back(std::vector<float>());
+                tracts.back().swap(results[index]);
+            }
+    }
+};
+
+#endif//BATCH_TRACKING_HPP
@@ -1,4 +1,7 @@
 #include <QCoreApplication>
+#include <limits>
+#include <thread>
+#include <chrono>
 #include "fib_data.hpp"
 #include "fa_template.hpp"
 #include "atlas.hpp"
@@ -302,16 +305,30 @@ bool tracking::get_nearest_dir_fib(unsigned int space_index,
                      unsigned char& fib_order_,
                      unsigned char& reverse_) const
 {
-    if(space_index >= dim.size() || fa[0][space_index] <= threshold)
+    if(space_index >= dim.size())
+        return false;
+    const float* record = get_record(space_index);
+    if((record ? record[0] : get_unpacked_fa(space_index,0)) <= threshold)
         return false;
     float max_value = cull_cos_angle;
     unsigned char fib_order;
     unsigned char reverse;
     for (unsigned char index = 0;index < fib_num;++index)
     {
-        if (fa[index][space_index] <= threshold)
-            continue;
-        float value = cos_angle(ref_dir,space_index,index);
+        float value;
+        if(record)
+        {
+            const float* fib = record + (index << 2);
+            if (fib[0] <= threshold)
+                continue;
+            value = ref_dir[0]*fib[1] + ref_dir[1]*fib[2] + ref_dir[2]*fib[3];
+        }
+        else
+        {
+            if (get_unpacked_fa(space_index,index) <= threshold)
+                continue;
+            value = cos_angle(ref_dir,space_index,index);
+        }
         if (-value > max_value)
         {
             max_value = -value;
@@ -332,16 +349,93 @@ bool tracking::get_nearest_dir_fib(unsigned int space_index,
     reverse_ = reverse;
     return true;
 }
+std::shared_ptr<const tracking::packed_records> tracking::build_records(void) const
+{
+    std::shared_ptr<packed_records> new_records;
+    unsigned int record_size = fib_num << 2;
+    size_t count = 0;
+    for(unsigned int index = 0;index < dim.size();++index)
+        if(get_unpacked_fa(index,0) > 0.0)
+            ++count;
+    if(!count || count*record_size >= no_record)
+        return new_records;
+    try{
+        new_records.reset(new packed_records);
+        new_records->voxel_record.resize(dim.size(),no_record);
+        new_records->records.resize(count*record_size);
+    }
+    catch(...)
+    {
+        new_records.reset();
+        return new_records;
+    }
+    std::vector<unsigned int>& voxel_record = new_records->voxel_record;
+    std::vector<float>& records = new_records->records;
+    const int block = 4;
+    unsigned int pos = 0;
+    for(int bz = 0;bz < dim[2];bz += block)
+    for(int by = 0;by < dim[1];by += block)
+    for(int bx = 0;bx < dim[0];bx += block)
+    for(int z = bz;z < bz+block && z < dim[2];++z)
+    for(int y = by;y < by+block && y < dim[1];++y)
+    for(int x = bx;x < bx+block && x < dim[0];++x)
+    {
+        unsigned int index = (z*dim[1]+y)*dim[0]+x;
+        if(get_unpacked_fa(index,0) <= 0.0)
+            continue;
+        voxel_record[index] = pos;
+        for(unsigned char fib = 0;fib < fib_num;++fib,pos += 4)
+        {
+            const float* d = get_unpacked_dir(index,fib);
+            records[pos] = get_unpacked_fa(index,fib);
+            records[pos+1] = d[0];
+            records[pos+2] = d[1];
+            records[pos+3] = d[2];
+        }
+    }
+    return new_records;
+}
+void tracking::pack(void)
+{
+    // sparse fa is looked up through its slots
+    if(packed || fa_slot)
+        return;
+    // the fib's own fa: share the records kept by fib_data
+    if(handle && fa == handle->dir.fa && findex == handle->dir.findex)
+        packed = handle->get_packed_records(*this);
+    else
+        packed = build_records();
+}
 void tracking::read(const fib_data& fib)
 {
+    handle = &fib;
     dim = fib.dim;
     vs = fib.vs;
     odf_table = fib.dir.odf_table;
     fib_num = fib.dir.num_fiber;
     fa = fib.dir.fa;
+    fa_slot = 0;
+    fa_mask = 0;
     findex = fib.dir.findex;
     dir = fib.dir.dir;
     other_index = fib.dir.index_data;
+    packed.reset();
+}
+std::shared_ptr<const tracking::packed_records> fib_data::get_packed_records(const tracking& trk) const
+{
+    std::lock_guard<std::mutex> lock(packed_mutex);
+    if(!packed || packed_fa != dir.fa || packed_findex != dir.findex)
+    {
+        packed = trk.build_records();
+        packed_fa = dir.fa;
+        packed_findex = dir.findex;
+    }
+    return packed;
+}
+void fib_data::clear_packed_records(void)
+{
+    std::lock_guard<std::mutex> lock(packed_mutex);
+    packed.reset();
 }
 bool tracking::get_dir(unsigned int space_index,
                      const image::vector<3,float>& dir, // reference direction, should be unit vector
@@ -361,21 +455,25 @@ bool tracking::get_dir(unsigned int space_index,
     return true;
 }
 
-const float* tracking::get_dir(unsigned int space_index,unsigned char fib_order) const
+const float* tracking::get_unpacked_dir(unsigned int space_index,unsigned char fib_order) const
 {
     if(!dir.empty())
         return dir[fib_order] + space_index + (space_index << 1);
     return &*(odf_table[findex[fib_order][space_index]].begin());
 }
 
+const float* tracking::get_dir(unsigned int space_index,unsigned char fib_order) const
+{
+    const float* record = get_record(space_index);
+    if(record)
+        return record + (fib_order << 2) + 1;
+    return get_unpacked_dir(space_index,fib_order);
+}
+
 float tracking::cos_angle(const image::vector<3>& cur_dir,unsigned int space_index,unsigned char fib_order) const
 {
-    if(!dir.empty())
-    {
-        const float* dir_at = dir[fib_order] + space_index + (space_index << 1);
-        return cur_dir[0]*dir_at[0] + cur_dir[1]*dir_at[1] + cur_dir[2]*dir_at[2];
-    }
-    return cur_dir*odf_table[findex[fib_order][space_index]];
+    const float* dir_at = get_dir(space_index,fib_order);
+    return cur_dir[0]*dir_at[0] + cur_dir[1]*dir_at[1] + cur_dir[2]*dir_at[2];
 }
 
 float tracking::get_track_specific_index(unsigned int space_index,unsigned int index_num,
@@ -391,13 +489,17 @@ float tracking::get_track_specific_index(unsigned int space_index,unsigned int i
 
 
 
-bool fib_data::load_from_file(const char* file_name)
+bool fib_data::load_from_file(const char* file_name,const char* stop_name)
 {
-    if (!mat_reader.load_from_file(file_name) || prog_aborted())
+    if (!(stop_name ? mat_reader.load_from_file(file_name,std::numeric_limits<int>::max(),stop_name):
+                      mat_reader.load_from_file(file_name)) || prog_aborted())
     {
         error_msg = prog_aborted() ? "loading process aborted" : "cannot open file";
         return false;
     }
+    fib_file_name = file_name;
+    mni_ready = false;
+    cached_mni.clear();
     return load_from_mat();
 }
 bool fib_data::load_from_mat(void)
@@ -637,19 +739,126 @@ bool fib_data::can_map_to_mni(void)
         return false;
     if(is_qsdr)
         return true;
-    if(!has_reg())
-    {
-        begin_prog("running normalization");
+    if(mni_ready)
+        return true;
+    begin_prog("running normalization");
+    if(!thread.has_started())
         run_normalization(1,true);
-        while(check_prog(reg.get_prog(),18) && !prog_aborted())
-            ;
-        check_prog(16,16);
+    // reg is still changing until the thread sets mni_ready
+    while(!mni_ready && check_prog(std::min<int>(reg.get_prog(),17),18) && !prog_aborted())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    check_prog(18,18);
+    return mni_ready;
+}
+
+// a mapping is reused only if the subject FA, the template and the norm factor are the same
+std::string fib_data::get_mni_mapping_key(int factor)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    auto add = [&hash](const void* data,size_t size)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        for(size_t i = 0;i < size;++i)
+            hash = (hash ^ p[i])*1099511628211ULL;
+    };
+    unsigned int geo[6] = {dim[0],dim[1],dim[2],
+                           fa_template_imp.I.geometry()[0],fa_template_imp.I.geometry()[1],fa_template_imp.I.geometry()[2]};
+    add(geo,sizeof(geo));
+    add(&vs[0],sizeof(float)*3);
+    add(dir.fa[0],sizeof(float)*dim.size());
+    add(&fa_template_imp.vs[0],sizeof(float)*3);
+    add(fa_template_imp.tran,sizeof(fa_template_imp.tran));
+    if(!fa_template_imp.I.empty())
+        add(&*fa_template_imp.I.begin(),sizeof(float)*fa_template_imp.I.size());
+    add(&factor,sizeof(factor));
+    std::ostringstream out;
+    out << std::hex << hash;
+    return out.str();
+}
+
+bool fib_data::load_mni_mapping(int factor)
+{
+    if(fa_template_imp.I.empty() || dir.fa.empty())
+        return false;
+    std::string key = get_mni_mapping_key(factor);
+    auto read_mapping = [&](gz_mat_read& in)->bool
+    {
+        unsigned int row,col;
+        const char* key_buf = 0;
+        const float* mapping = 0;
+        if(!in.read("mni_mapping_key",row,col,key_buf) || std::string(key_buf,key_buf+row*col) != key ||
+           !in.read("mni_mapping",row,col,mapping) || row*col != dim.size()*3)
+            return false;
+        cached_mni.resize(dim);
+        std::copy(mapping,mapping+row*col,&cached_mni[0][0]);
+        return true;
+    };
+    if(read_mapping(mat_reader))
+        return true;
+    gz_mat_read in;
+    return !fib_file_name.empty() &&
+           in.load_from_file((fib_file_name+".mni.gz").c_str()) && read_mapping(in);
+}
+
+// reg was set directly (e.g. by manual alignment) and replaces a loaded mapping
+void fib_data::update_mni_mapping(void)
+{
+    mni_ready = false;
+    cached_mni.clear();
+    mni_ready = true;
+}
+
+bool fib_data::save_mni_mapping(int factor)
+{
+    if(fib_file_name.empty() || dir.fa.empty())
+        return false;
+    // reg sampled at every voxel, interpolated by subject2mni once loaded
+    image::basic_image<image::vector<3,float>,3> mni(dim);
+    image::par_for(dim.size(),[&](int index)
+    {
+        image::vector<3> pos(image::pixel_index<3>(index,dim).begin());
+        reg(pos);
+        fa_template_imp.to_mni(pos);
+        mni[index] = pos;
+    });
+    std::string key = get_mni_mapping_key(factor);
+    // a memory-mapped fib file is not rewritten, the mapping goes to the side file
+    bool embed = embed_mni_mapping && !mmap_mat_read::is_mmap_mat(fib_file_name.c_str());
+    std::string file_name = embed ? fib_file_name : fib_file_name+".mni.gz";
+    std::string temp_file = gz_temp_file_name(file_name);
+    try
+    {
+        gz_mat_write out(temp_file.c_str());
+        if(!out)
+            return false;
+        if(embed)
+        {
+            for(unsigned int index = 0;index < mat_reader.size();++index)
+                if(mat_reader.name(index) != "mni_mapping_key" &&
+                   mat_reader.name(index) != "mni_mapping")
+                    mat_reader.write_to(out,index);
+        }
+        out.write("mni_mapping_key",key.c_str(),1,(unsigned int)key.length());
+        out.write("mni_mapping",&mni[0][0],3,(unsigned int)mni.size());
     }
-    return true;
+    catch(const std::exception&)
+    {
+        // this may run on the normalization thread, where an exception would end the program
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return gz_replace_file(temp_file,file_name);
 }
 
 void fib_data::run_normalization(int factor,bool background)
 {
+    mni_ready = false;
+    cached_mni.clear();
+    if(cache_mni_mapping && load_mni_mapping(factor))
+    {
+        mni_ready = true;
+        return;
+    }
     auto lambda = [this,factor]()
     {
         image::basic_image<float,3> from(dir.fa[0],dim),to(fa_template_imp.I);
@@ -660,6 +869,11 @@ void fib_data::run_normalization(int factor,bool background)
         image::normalize(to,1.0);
         reg.run_reg(from,vs,fa_template_imp.I,fa_template_imp.vs,
                     factor,image::reg::corr,image::reg::affine,thread.terminated,std::thread::hardware_concurrency());
+        if(thread.terminated)
+            return;
+        mni_ready = true;
+        if(cache_mni_mapping)
+            save_mni_mapping(factor);
     };
 
     if(background)
@@ -679,6 +893,45 @@ void fib_data::subject2mni(image::vector<3>& pos)
         pos.to(trans_to_mni);
         return;
     }
+    if(!mni_ready)
+        return;
+    if(!cached_mni.empty())
+    {
+        // trilinear interpolation of the loaded mapping, exact at voxel centers.
+        // Outside the volume the edge cells are extrapolated linearly, which
+        // reproduces the affine mapping of reg instead of clamping to the edge.
+        int i0[3],i1[3];
+        float w1[3];
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            i0[d] = std::max<float>(0.0f,std::min<float>(std::floor(pos[d]),int(dim[d])-2));
+            i1[d] = std::min<int>(i0[d]+1,dim[d]-1);
+            w1[d] = i1[d] == i0[d] ? 0.0f : pos[d]-i0[d];
+        }
+        image::vector<3> result;
+        for(unsigned int corner = 0;corner < 8;++corner)
+        {
+            float w = 1.0f;
+            int index[3];
+            for(unsigned int d = 0;d < 3;++d)
+                if(corner & (1 << d))
+                {
+                    index[d] = i1[d];
+                    w *= w1[d];
+                }
+                else
+                {
+                    index[d] = i0[d];
+                    w *= 1.0f-w1[d];
+                }
+            const image::vector<3,float>& v = cached_mni.at(index[0],index[1],index[2]);
+            result[0] += v[0]*w;
+            result[1] += v[1]*w;
+            result[2] += v[2]*w;
+        }
+        pos = result;
+        return;
+    }
     reg(pos);
     fa_template_imp.to_mni(pos);
 }
@@ -686,13 +939,33 @@ void fib_data::subject2mni(image::vector<3>& pos)
 void fib_data::get_atlas_roi(int atlas_index,int roi_index,std::vector<image::vector<3,short> >& points)
 {
     points.clear();
-    for (image::pixel_index<3>index(dim); index < dim.size(); ++index)
+    std::vector<std::vector<image::vector<3,short> > > region_points;
+    get_atlas_roi(atlas_index,region_points);
+    if(roi_index < 0 || (unsigned int)roi_index >= region_points.size())
+        return;
+    points.swap(region_points[roi_index]);
+}
+void fib_data::get_atlas_roi(int atlas_index,std::vector<std::vector<image::vector<3,short> > >& points)
+{
+    points.clear();
+    image::basic_image<image::vector<3,float>,3> mni_position(dim);
+    image::par_for(dim.size(),[&](int index)
     {
-        image::vector<3> mni(index.begin());
+        image::vector<3> mni(image::pixel_index<3>(index,dim).begin());
         subject2mni(mni);
-        if (!atlas_list[atlas_index].is_labeled_as(mni, roi_index))
-            continue;
-        points.push_back(image::vector<3,short>(index.begin()));
+        mni_position[index] = mni;
+    });
+    image::basic_image<uint64_t,3> label_volume;
+    std::vector<std::vector<unsigned int> > region_voxels;
+    atlas_list[atlas_index].get_label_volume(mni_position,label_volume);
+    atlas_list[atlas_index].get_region_voxels(label_volume,region_voxels);
+    points.resize(region_voxels.size());
+    for(unsigned int roi = 0;roi < region_voxels.size();++roi)
+    {
+        const std::vector<unsigned int>& voxels = region_voxels[roi];
+        points[roi].resize(voxels.size());
+        for(unsigned int i = 0;i < voxels.size();++i)
+            points[roi][i] = image::vector<3,short>(image::pixel_index<3>(voxels[i],dim).begin());
     }
 }
 
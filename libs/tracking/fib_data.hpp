@@ -3,6 +3,9 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include "prog_interface_static_link.h"
 #include "image/image.hpp"
 #include "gzip_interface.hpp"
@@ -63,12 +66,62 @@ public:
     image::vector<3> vs;
     unsigned char fib_num;
     std::vector<const float*> dir;
-    std::vector<const float*> fa;
-    std::vector<const short*> findex;
     std::vector<std::vector<const float*> > other_index;
     std::vector<image::vector<3,float> > odf_table;
     float threshold;
     float cull_cos_angle;
+private:// changed only through read() and set_fa(), so that packed records never outlive them
+    const fib_data* handle = 0;
+    std::vector<const float*> fa;
+    std::vector<const short*> findex;
+public:
+    // sparse fa: fa[fib] holds only the voxels where fa_mask is not zero,
+    // and fa_slot maps a voxel to its position in fa[fib]
+    const unsigned int* fa_slot = 0;
+    const float* fa_mask = 0;
+    const std::vector<const float*>& get_fa_data(void) const{return fa;}
+    float get_unpacked_fa(unsigned int space_index,unsigned char fib_order) const
+    {
+        if(!fa_slot)
+            return fa[fib_order][space_index];
+        return fa_mask[space_index] == 0.0f ? 0.0f : fa[fib_order][fa_slot[space_index]];
+    }
+public:
+    // packed fiber records: each voxel with fibers has fib_num x (fa,dx,dy,dz),
+    // stored in 4x4x4 voxel blocks so that neighboring voxels share cache lines.
+    // They are built by pack() for the tracking threads, and those of the fib's
+    // own fa are kept by fib_data so that all tracking runs share one copy.
+    static const unsigned int no_record = 0xFFFFFFFF;
+    struct packed_records{
+        std::vector<unsigned int> voxel_record;
+        std::vector<float> records;
+    };
+    std::shared_ptr<const packed_records> build_records(void) const;
+private:
+    std::shared_ptr<const packed_records> packed;
+    const float* get_unpacked_dir(unsigned int space_index,unsigned char fib_order) const;
+public:
+    void pack(void);
+    bool is_packed(void) const{return packed.get();}
+    const float* get_record(unsigned int space_index) const
+    {
+        if(!packed || packed->voxel_record[space_index] == no_record)
+            return 0;
+        return &packed->records[packed->voxel_record[space_index]];
+    }
+    // replaces fa (e.g. by a connectometry result), the records packed from the old fa are dropped
+    void set_fa(const std::vector<const float*>& fa_,const unsigned int* fa_slot_ = 0,const float* fa_mask_ = 0)
+    {
+        fa = fa_;
+        fa_slot = fa_slot_;
+        fa_mask = fa_mask_;
+        packed.reset();
+    }
+    float get_fa(unsigned int space_index,unsigned char fib_order) const
+    {
+        const float* record = get_record(space_index);
+        return record ? record[fib_order << 2] : get_unpacked_fa(space_index,fib_order);
+    }
 public:
     bool get_nearest_dir_fib(unsigned int space_index,
                          const image::vector<3,float>& ref_dir, // reference direction, should be unit vector
@@ -133,18 +186,42 @@ public:
     void run_normalization(int factor,bool background);
     void subject2mni(image::vector<3>& pos);
     void get_atlas_roi(int atlas_index,int roi_index,std::vector<image::vector<3,short> >& points);
+    // points of every region of the atlas, from one label volume
+    void get_atlas_roi(int atlas_index,std::vector<std::vector<image::vector<3,short> > >& points);
     void get_mni_mapping(image::basic_image<image::vector<3,float>,3 >& mni_position);
-    bool has_reg(void)const{return thread.has_started();}
+    bool has_reg(void)const{return mni_ready;}
+public:// subject-to-MNI mapping of each voxel loaded from an earlier normalization; if empty, reg is used
+    std::string fib_file_name;
+    image::basic_image<image::vector<3,float>,3> cached_mni;
+    // set once reg or cached_mni is complete, they are not changed while it is set
+    std::atomic<bool> mni_ready;
+    bool cache_mni_mapping;  // reuse and store the mapping in fib_file_name+".mni.gz"
+    bool embed_mni_mapping;  // store the mapping in the fib file instead
+    std::string get_mni_mapping_key(int factor);
+    void update_mni_mapping(void);
+    bool load_mni_mapping(int factor);
+    bool save_mni_mapping(int factor);
+private:// records packed from dir.fa and dir.findex, see tracking::pack
+    mutable std::mutex packed_mutex;
+    mutable std::shared_ptr<const tracking::packed_records> packed;
+    mutable std::vector<const float*> packed_fa;
+    mutable std::vector<const short*> packed_findex;
+public:
+    std::shared_ptr<const tracking::packed_records> get_packed_records(const tracking& trk) const;
+    // call after dir.fa or dir.findex are modified in place
+    void clear_packed_records(void);
+public:
     void get_profile(const std::vector<float>& tract_data,
                      std::vector<float>& profile);
 
 public:
-    fib_data(void):is_qsdr(false)
+    fib_data(void):is_qsdr(false),mni_ready(false),cache_mni_mapping(true),embed_mni_mapping(false)
     {
         vs[0] = vs[1] = vs[2] = 1.0;
     }
 public:
-    bool load_from_file(const char* file_name);
+    // a stop_name loads the matrices only up to that matrix
+    bool load_from_file(const char* file_name,const char* stop_name = 0);
     bool load_from_mat(void);
 public:
     bool has_odfs(void) const{return odf.has_odfs();}
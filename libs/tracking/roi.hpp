@@ -6,41 +6,24 @@
 class Roi {
 private:
     image::geometry<3> dim;
-    std::vector<std::vector<std::vector<unsigned char> > > roi_filter;
-    bool in_range(int x,int y,int z) const
-    {
-        return dim.is_valid(x,y,z);
-    }
+    std::vector<unsigned char> mask;
 public:
-    Roi(const image::geometry<3>& geo):dim(geo),roi_filter(dim[0])
-    {
-        for(unsigned int x = 0; x < dim[0]; ++x)
-        {
-            std::vector<std::vector<unsigned char> >&
-            roi_filter_x = roi_filter[x];
-            roi_filter_x.resize(dim[1]);
-            for(unsigned int y = 0; y < dim[1]; ++y)
-                roi_filter_x[y].resize(dim[2]);
-        }
-    }
+    Roi(const image::geometry<3>& geo):dim(geo),mask(geo.size()){}
     void clear(void)
     {
-        for(unsigned int x = 0; x < roi_filter.size(); ++x)
-            for(unsigned int y = 0; y < roi_filter[x].size(); ++y)
-                for(unsigned int z = 0; z < roi_filter[x][y].size(); ++z)
-                    roi_filter[x][y][z] = 0;
+        std::fill(mask.begin(),mask.end(),0);
     }
     void addPoint(const image::vector<3,short>& new_point)
     {
-        if(in_range(new_point.x(),new_point.y(),new_point.z()))
-            roi_filter[new_point.x()][new_point.y()][new_point.z()] = 1;
+        if(dim.is_valid(new_point.x(),new_point.y(),new_point.z()))
+            mask[(new_point.z()*dim[1]+new_point.y())*dim[0]+new_point.x()] = 1;
     }
     bool havePoint(float dx,float dy,float dz) const
     {
         short x = std::floor(dx+0.5);
         short y = std::floor(dy+0.5);
         short z = std::floor(dz+0.5);
-        return in_range(x,y,z) && roi_filter[x][y][z];
+        return dim.is_valid(x,y,z) && mask[(z*dim[1]+y)*dim[0]+x];
     }
     bool havePoint(const image::vector<3,float>& point) const
     {
@@ -62,27 +45,82 @@ public:
     std::vector<std::shared_ptr<Roi> > end;
     std::auto_ptr<Roi> exclusive;
     std::auto_ptr<Roi> terminate;
-
 public:
+    static const unsigned int exclusive_label = 1;
+    static const unsigned int terminate_label = 2;
+private:
+    // combined label volume: each region owns one bit, so that a single lookup
+    // tells all regions at a point. Falls back to the Roi masks if more than
+    // 30 inclusive and end regions are assigned.
+    image::geometry<3> label_dim;
+    std::vector<unsigned int> label;
+    std::vector<unsigned int> inclusive_label,end_label;
+    unsigned int inclusive_mask;
+    unsigned int next_label;
+    bool use_label;
+    unsigned int add_label(const image::geometry<3>& geo,
+                           const std::vector<image::vector<3,short> >& points,
+                           unsigned int new_label)
+    {
+        if(!new_label)
+            use_label = false;
+        if(!use_label)
+        {
+            label.clear();
+            return 0;
+        }
+        if(label.empty())
+        {
+            label_dim = geo;
+            label.resize(geo.size());
+        }
+        for(unsigned int index = 0; index < points.size(); ++index)
+            if(geo.is_valid(points[index].x(),points[index].y(),points[index].z()))
+                label[(points[index].z()*geo[1]+points[index].y())*geo[0]+points[index].x()] |= new_label;
+        return new_label;
+    }
+    unsigned int get_new_label(void)
+    {
+        unsigned int new_label = next_label;
+        next_label <<= 1;
+        return new_label;
+    }
+public:
+    RoiMgr(void):inclusive_mask(0),next_label(4),use_label(true){}
     void clear(void)
     {
         inclusive.clear();
         end.clear();
         exclusive.reset(0);
         terminate.reset(0);
+        label_dim = image::geometry<3>();
+        label.clear();
+        inclusive_label.clear();
+        end_label.clear();
+        inclusive_mask = 0;
+        next_label = 4;
+        use_label = true;
+    }
+    // labels of the regions at the point
+    unsigned int get_label(const image::vector<3,float>& point) const
+    {
+        short x = std::floor(point[0]+0.5);
+        short y = std::floor(point[1]+0.5);
+        short z = std::floor(point[2]+0.5);
+        if(!label.empty())
+            return label_dim.is_valid(x,y,z) ? label[(z*label_dim[1]+y)*label_dim[0]+x] : 0;
+        if(use_label)// no region assigned
+            return 0;
+        return (exclusive.get() && exclusive->havePoint(point) ? exclusive_label : 0) |
+               (terminate.get() && terminate->havePoint(point) ? terminate_label : 0);
     }
-
     bool is_excluded_point(const image::vector<3,float>& point) const
     {
-        if(!exclusive.get())
-            return false;
-        return exclusive->havePoint(point[0],point[1],point[2]);
+        return get_label(point) & exclusive_label;
     }
     bool is_terminate_point(const image::vector<3,float>& point) const
     {
-        if(!terminate.get())
-            return false;
-        return terminate->havePoint(point[0],point[1],point[2]);
+        return get_label(point) & terminate_label;
     }
 
 
@@ -91,6 +129,28 @@ public:
     {
         if(end.empty())
             return true;
+        if(use_label)
+        {
+            unsigned int label1 = get_label(point1);
+            unsigned int label2 = get_label(point2);
+            if(end.size() == 1)
+                return (label1 | label2) & end_label[0];
+            if(end.size() == 2)
+                return ((label1 & end_label[0]) && (label2 & end_label[1])) ||
+                       ((label1 & end_label[1]) && (label2 & end_label[0]));
+            bool end_point1 = false;
+            bool end_point2 = false;
+            for(unsigned int index = 0; index < end.size(); ++index)
+            {
+                if(label1 & end_label[index])
+                    end_point1 = true;
+                else if(label2 & end_label[index])
+                    end_point2 = true;
+                if(end_point1 && end_point2)
+                    return true;
+            }
+            return false;
+        }
         if(end.size() == 1)
             return end[0]->havePoint(point1) ||
                    end[0]->havePoint(point2);
@@ -115,11 +175,29 @@ public:
 
     bool have_include(const float* track,unsigned int buffer_size) const
     {
+        if(inclusive.empty())
+            return true;
+        if(use_label)
+        {
+            unsigned int labels = 0;
+            for(unsigned int index = 0; index < buffer_size && (labels & inclusive_mask) != inclusive_mask; index += 3)
+                labels |= get_label(image::vector<3,float>(track[index],track[index+1],track[index+2]));
+            return (labels & inclusive_mask) == inclusive_mask;
+        }
         for(unsigned int index = 0; index < inclusive.size(); ++index)
             if(!inclusive[index]->included(track,buffer_size))
                 return false;
         return true;
     }
+    // labels: the labels of all track points ORed during tracking
+    bool have_include(unsigned int labels,const float* track,unsigned int buffer_size) const
+    {
+        if(inclusive.empty())
+            return true;
+        if(use_label)
+            return (labels & inclusive_mask) == inclusive_mask;
+        return have_include(track,buffer_size);
+    }
 
     void add_inclusive_roi(const image::geometry<3>& geo,
                            const std::vector<image::vector<3,short> >& points)
@@ -127,6 +205,8 @@ public:
         inclusive.push_back(std::make_shared<Roi>(geo));
         for(unsigned int index = 0; index < points.size(); ++index)
             inclusive.back()->addPoint(points[index]);
+        inclusive_label.push_back(add_label(geo,points,get_new_label()));
+        inclusive_mask |= inclusive_label.back();
     }
     void add_end_roi(const image::geometry<3>& geo,
                      const std::vector<image::vector<3,short> >& points)
@@ -134,6 +214,7 @@ public:
         end.push_back(std::make_shared<Roi>(geo));
         for(unsigned int index = 0; index < points.size(); ++index)
             end.back()->addPoint(points[index]);
+        end_label.push_back(add_label(geo,points,get_new_label()));
     }
 
     void add_exclusive_roi(const image::geometry<3>& geo,
@@ -143,6 +224,7 @@ public:
             exclusive.reset(new Roi(geo));
         for(unsigned int index = 0; index < points.size(); ++index)
             exclusive->addPoint(points[index]);
+        add_label(geo,points,exclusive_label);
     }
     void add_terminate_roi(const image::geometry<3>& geo,
                            const std::vector<image::vector<3,short> >& points)
@@ -151,6 +233,7 @@ public:
             terminate.reset(new Roi(geo));
         for(unsigned int index = 0; index < points.size(); ++index)
             terminate->addPoint(points[index]);
+        add_label(geo,points,terminate_label);
     }
 
 
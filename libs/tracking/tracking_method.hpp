@@ -2,6 +2,7 @@
 #define STREAM_LINE_HPP
 #include <ctime>
 #include <random>
+#include <stdint.h>
 #include <boost/mpl/vector.hpp>
 #include <boost/mpl/for_each.hpp>
 #include <deque>
@@ -30,6 +31,31 @@ typedef boost::mpl::vector<
 
 
 
+/*
+ Counter-based random number stream for one seed. The n-th number depends only
+ on (global seed, seed ordinal, n), so a seed gets the same position and
+ direction no matter which thread tracks it.
+ */
+class seed_generator{
+    uint64_t key,counter;
+    static uint64_t mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+public:
+    typedef uint32_t result_type;
+    seed_generator(unsigned int global_seed,unsigned int ordinal):
+        key(mix(mix(global_seed)+ordinal)),counter(0){}
+    static constexpr result_type min(void){return 0;}
+    static constexpr result_type max(void){return 0xFFFFFFFF;}
+    result_type operator()(void)
+    {
+        return mix(key + (++counter)*0x9E3779B97F4A7C15ULL) >> 32;
+    }
+};
+
 struct TrackingParam
 {
     float step_size;
@@ -118,19 +144,22 @@ public:
         buffer_front_pos = param.max_points_count3;
         buffer_back_pos = param.max_points_count3;
         image::vector<3,float> end_point1;
+        unsigned int labels = 0,label; // region labels passed by the track
         failed = false;
         terminated = false;
 		do
 		{
             if(get_buffer_size() > param.max_points_count3 || buffer_back_pos + 3 >= track_buffer.size())
 				return false;
-            if(roi_mgr.is_excluded_point(position))
+            label = roi_mgr.get_label(position);
+            if(label & RoiMgr::exclusive_label)
 				return false;
             track_buffer[buffer_back_pos] = position[0];
             track_buffer[buffer_back_pos+1] = position[1];
             track_buffer[buffer_back_pos+2] = position[2];
             buffer_back_pos += 3;
-            if(roi_mgr.is_terminate_point(position))
+            labels |= label;
+            if(label & RoiMgr::terminate_label)
                 break;
             tracking(ProcessList());
 			// make sure that the length won't overflow
@@ -155,13 +184,15 @@ public:
             if(terminated)
 				break;
 			buffer_front_pos -= 3;
-            if(roi_mgr.is_excluded_point(position))
+            label = roi_mgr.get_label(position);
+            if(label & RoiMgr::exclusive_label)
 				return false;
             track_buffer[buffer_front_pos] = position[0];
             track_buffer[buffer_front_pos+1] = position[1];
             track_buffer[buffer_front_pos+2] = position[2];
+            labels |= label;
         }
-        while(!roi_mgr.is_terminate_point(position));
+        while(!(label & RoiMgr::terminate_label));
 
         if(smoothing)
         {
@@ -188,14 +219,15 @@ public:
 
         return !failed &&
                get_buffer_size() >= param.min_points_count3 &&
-               roi_mgr.have_include(get_result(),get_buffer_size()) &&
+               (smoothing ? roi_mgr.have_include(get_result(),get_buffer_size()) :
+                            roi_mgr.have_include(labels,get_result(),get_buffer_size())) &&
                roi_mgr.fulfill_end_point(position,end_point1);
 
 
 	}
         bool init(unsigned char initial_direction,
                   const image::vector<3,float>& position_,
-                  std::mt19937& seed)
+                  seed_generator& seed)
         {
             std::uniform_real_distribution<float> gen(0,1);
             position = position_;
@@ -211,7 +243,7 @@ public:
             {
             case 0:// main direction
                 {
-                    if(trk.fa[0][index.index()] < trk.threshold)
+                    if(trk.get_fa(index.index(),0) < trk.threshold)
                         return false;
                     dir = trk.get_dir(index.index(),0);
                 }
@@ -231,7 +263,7 @@ public:
             case 2:// all direction
                 {
                     if (init_fib_index >= trk.fib_num ||
-                        trk.fa[init_fib_index][index.index()] < trk.threshold)
+                        trk.get_fa(index.index(),init_fib_index) < trk.threshold)
                     {
                         init_fib_index = 0;
                         return false;
@@ -251,6 +283,7 @@ public:
             switch (tracking_method)
             {
             case 0:
+            case 3:// batched streamline when the fiber records are not packed
                 if (!start_tracking<streamline_method_process>(false))
                     return 0;
                 break;
@@ -1,14 +1,34 @@
 #include "tracking_thread.hpp"
+#include <limits>
 #include "fib_data.hpp"
-void ThreadData::push_tracts(std::vector<std::vector<float> >& local_tract_buffer)
+void ThreadData::commit_chunk(unsigned int chunk,std::vector<std::vector<float> >& tracts)
 {
     std::lock_guard<std::mutex> lock(lock_feed_function);
-    for(unsigned int index = 0;index < local_tract_buffer.size();++index)
+    if(tracking_ended)
+        return;
+    pending_chunks[chunk].swap(tracts);
+    // chunks finished by other threads wait here until all chunks before them are committed
+    for(auto iter = pending_chunks.begin();iter != pending_chunks.end() && iter->first == next_chunk;)
     {
-        track_buffer.push_back(std::vector<float>());
-        track_buffer.back().swap(local_tract_buffer[index]);
+        std::vector<std::vector<float> >& chunk_tracts = iter->second;
+        for(unsigned int index = 0;index < chunk_tracts.size();++index)
+        {
+            if(stop_by_tract && committed_count >= termination_count)
+                break;
+            track_buffer.push_back(std::vector<float>());
+            track_buffer.back().swap(chunk_tracts[index]);
+            ++committed_count;
+        }
+        iter = pending_chunks.erase(iter);
+        ++next_chunk;
+        if((stop_by_tract && committed_count >= termination_count) ||
+           uint64_t(next_chunk)*seed_chunk_size >= seed_ordinal_end)
+        {
+            tracking_ended = true;
+            pending_chunks.clear();
+            break;
+        }
     }
-    local_tract_buffer.clear();
 }
 void ThreadData::end_thread(void)
 {
@@ -21,63 +41,75 @@ void ThreadData::end_thread(void)
     }
 }
 
-void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_count,unsigned int thread_id,unsigned int max_count)
+void ThreadData::track_seed(TrackingMethod* method,BatchTracking* batch,unsigned int ordinal,std::vector<std::vector<float> >& tracts)
 {
-    std::auto_ptr<TrackingMethod> method(method_ptr);
     std::uniform_real_distribution<float> rand_gen(0,1);
-    unsigned int iteration = thread_id; // for center seed
+    seed_generator gen(global_seed,ordinal);
+    image::vector<3,float> pos;
+    if(center_seed)
+        pos = image::vector<3,float>(seeds[ordinal].x(),seeds[ordinal].y(),seeds[ordinal].z());
+    else
+    {
+        unsigned int i = rand_gen(gen)*((float)seeds.size()-1.0);
+        pos[0] = (float)seeds[i].x() + rand_gen(gen)-0.5;
+        pos[1] = (float)seeds[i].y() + rand_gen(gen)-0.5;
+        pos[2] = (float)seeds[i].z() + rand_gen(gen)-0.5;
+    }
+    // all direction seeding tracks every fiber population at the seed
+    do{
+        if(!method->init(initial_direction,pos,gen))
+            return;
+        if(batch)
+        {
+            batch->add_seed(method->position,method->dir);
+            continue;
+        }
+        unsigned int point_count;
+        const float *result = method->tracking(tracking_method,point_count);
+        if (result && point_count)
+            tracts.push_back(std::vector<float>(result,result+point_count+point_count+point_count));
+    }while(initial_direction == 2);
+}
+
+void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_id)
+{
+    std::auto_ptr<TrackingMethod> method(method_ptr);
+    std::auto_ptr<BatchTracking> batch;
+    // the batch engine interpolates trilinearly, other strategies use the scalar streamline
+    if(tracking_method == 3 && interpolation_strategy == 0 && packed_trk.is_packed())
+        batch.reset(new BatchTracking(packed_trk,roi_mgr,param));
     if(!seeds.empty())
     try{
-        std::vector<std::vector<float> > local_track_buffer;
-        while(!joinning &&
-              (!stop_by_tract || tract_count[thread_id] < max_count) &&
-              (stop_by_tract || seed_count[thread_id] < max_count) &&
-              (max_seed_count == 0 || seed_count[thread_id] < max_seed_count) &&
-              (!center_seed || iteration < seeds.size()))
+        std::vector<std::vector<float> > chunk_tracts;
+        while(!joinning && !tracking_ended)
         {
-            ++seed_count[thread_id];
-            if(center_seed)
-            {
-                if(!method->init(initial_direction,
-                                 image::vector<3,float>(seeds[iteration].x(),seeds[iteration].y(),seeds[iteration].z()),
-                                 seed))
-                {
-                    iteration+=thread_count;
-                    continue;
-                }
-                if(initial_direction == 0)// primary direction
-                    iteration+=thread_count;
-            }
-            else
+            // claim the next chunk, so threads with fast chunks simply take more of them
+            unsigned int chunk = claimed_chunk++;
+            uint64_t from = uint64_t(chunk)*seed_chunk_size;
+            if(from >= seed_ordinal_end)
+                break;
+            uint64_t to = std::min<uint64_t>(seed_ordinal_end,from+seed_chunk_size);
+            chunk_tracts.clear();
+            for(uint64_t ordinal = from;ordinal < to && !joinning && !tracking_ended;++ordinal)
             {
-                // this ensure consistency
-                std::lock_guard<std::mutex> lock(lock_seed_function);
-                iteration+=thread_count;
-                unsigned int i = rand_gen(seed)*((float)seeds.size()-1.0);
-                image::vector<3,float> pos;
-                pos[0] = (float)seeds[i].x() + rand_gen(seed)-0.5;
-                pos[1] = (float)seeds[i].y() + rand_gen(seed)-0.5;
-                pos[2] = (float)seeds[i].z() + rand_gen(seed)-0.5;
-                if(!method->init(initial_direction,pos,seed))
-                    continue;
+                ++seed_count[thread_id];
+                size_t count = chunk_tracts.size();
+                track_seed(method.get(),batch.get(),ordinal,chunk_tracts);
+                tract_count[thread_id] += chunk_tracts.size()-count;
             }
-            unsigned int point_count;
-            const float *result = method->tracking(tracking_method,point_count);
-            if (result && point_count)
+            if(batch.get())
             {
-                ++tract_count[thread_id];
-                local_track_buffer.push_back(std::vector<float>(result,result+point_count+point_count+point_count));
+                batch->run(chunk_tracts);
+                tract_count[thread_id] += chunk_tracts.size();
             }
-            if((iteration & 0x00000FFF) == 0x00000FFF && !local_track_buffer.empty())
-                push_tracts(local_track_buffer);
+            if(!joinning)
+                commit_chunk(chunk,chunk_tracts);
         }
-        push_tracts(local_track_buffer);
     }
     catch(...)
     {
 
     }
-    running[thread_id] = 0;
 }
 
 bool ThreadData::fetchTracks(TractModel* handle)
@@ -85,9 +117,13 @@ bool ThreadData::fetchTracks(TractModel* handle)
     if (track_buffer.empty())
         return false;
 
-    std::lock_guard<std::mutex> lock(lock_feed_function);
-    handle->add_tracts(track_buffer);
-    track_buffer.clear();
+    // take the committed tracts under the lock, swap them into the model outside of it
+    std::vector<std::vector<float> > committed;
+    {
+        std::lock_guard<std::mutex> lock(lock_feed_function);
+        committed.swap(track_buffer);
+    }
+    handle->add_tracts(committed);
     return true;
 
 }
@@ -153,7 +189,7 @@ void ThreadData::run(const tracking& trk,
            << seed_report
            << " The angular threshold was " << (int)std::floor(std::acos(trk.cull_cos_angle)*180/3.1415926 + 0.5) << " degrees."
            << " The step size was " << param.step_size << " mm.";
-    if(int(trk.threshold*1000) == int(600*image::segmentation::otsu_threshold(image::make_image(trk.fa[0],trk.dim))))
+    if(!trk.fa_slot && int(trk.threshold*1000) == int(600*image::segmentation::otsu_threshold(image::make_image(trk.get_fa_data()[0],trk.dim))))
         report << " The anisotropy threshold was determined automatically by DSI Studio.";
     else
         report << " The anisotropy threshold was " << trk.threshold << ".";
@@ -169,9 +205,6 @@ void ThreadData::run(const tracking& trk,
 
     if(!termination_count)
         return;
-    // to ensure consistency, seed initialization with all orientation only fits with single thread
-    if(initial_direction == 2)
-        thread_count = 1;
     param.step_size_in_voxel[0] = param.step_size/trk.vs[0];
     param.step_size_in_voxel[1] = param.step_size/trk.vs[1];
     param.step_size_in_voxel[2] = param.step_size/trk.vs[2];
@@ -181,32 +214,47 @@ void ThreadData::run(const tracking& trk,
         std::srand(0);
         std::random_shuffle(seeds.begin(),seeds.end());
     }
+    end_thread();
+    joinning = false;
+
+    // threads read packed fiber records: those of the fib's own fa are built once
+    // and kept by fib_data, those of a replaced fa (connectometry results) per run
+    packed_trk = trk;
+    if(!packed_trk.is_packed())
+        packed_trk.pack();
+
+    // seed ordinals to be tracked, each one has its own random stream so that
+    // the tract set does not depend on the thread count
+    this->termination_count = termination_count;
+    seed_ordinal_end = stop_by_tract ? (max_seed_count ? max_seed_count : std::numeric_limits<unsigned int>::max()) : termination_count;
+    if(center_seed)
+        seed_ordinal_end = std::min<unsigned int>(seed_ordinal_end,seeds.size());
+    claimed_chunk = 0;
+    next_chunk = 0;
+    committed_count = 0;
+    pending_chunks.clear();
+    tracking_ended = false;
+
+    unsigned int chunk_count = (uint64_t(seed_ordinal_end)+seed_chunk_size-1)/seed_chunk_size;
+    thread_count = std::max<unsigned int>(1,std::min<unsigned int>(thread_count,chunk_count));
     seed_count.clear();
     tract_count.clear();
     seed_count.resize(thread_count);
     tract_count.resize(thread_count);
-    running.resize(thread_count);
-    std::fill(running.begin(),running.end(),1);
 
-    end_thread();
-    if(thread_count > termination_count)
-        thread_count = termination_count;
-    unsigned int run_count = std::max<int>(1,termination_count/thread_count);
-    unsigned int total_run_count = 0;
-    for (unsigned int index = 0;index < thread_count-1;++index,total_run_count += run_count)
+    for (unsigned int index = 0;index < thread_count-1;++index)
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-                [this,&trk,thread_count,index,run_count](){run_thread(new_method(trk),thread_count,index,run_count);})));
-
+                [this,index](){run_thread(new_method(packed_trk),index);})));
 
     if(wait)
     {
-        run_thread(new_method(trk),thread_count,thread_count-1,termination_count-total_run_count);
+        run_thread(new_method(packed_trk),thread_count-1);
         for(int i = 0;i < threads.size();++i)
             threads[i]->wait();
     }
     else
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-                [this,&trk,thread_count,termination_count,total_run_count](){run_thread(new_method(trk),thread_count,thread_count-1,termination_count-total_run_count);})));
+                [this,thread_count](){run_thread(new_method(packed_trk),thread_count-1);})));
 
     report << " A total of " << termination_count << (stop_by_tract ? " tracts were calculated.":" seeds were placed.");
 }
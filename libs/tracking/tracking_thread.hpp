@@ -4,16 +4,21 @@
 #include <ctime>
 #include <random>
 #include <memory>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <future>
 
 #include "roi.hpp"
 #include "tracking_method.hpp"
+#include "batch_tracking.hpp"
 #include "fib_data.hpp"
 #include "tract_model.hpp"
 
 struct ThreadData
 {
 private:
-    std::mt19937 seed;
+    unsigned int global_seed;
 
 public:
     RoiMgr roi_mgr;
@@ -31,8 +36,8 @@ public:
     unsigned int max_seed_count;
 public:
     ThreadData(bool random_seed):
+        global_seed(random_seed ? std::random_device()():0),
         joinning(false),
-        seed(random_seed ? std::random_device()():0),
         stop_by_tract(true),
         center_seed(false),
         termination_count(1000),
@@ -49,9 +54,8 @@ public:
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> seed_count;
     std::vector<unsigned int> tract_count;
-    std::vector<unsigned char> running;
-    bool joinning;
-    std::mutex  lock_feed_function,lock_seed_function;
+    std::atomic<bool> joinning;
+    std::mutex  lock_feed_function;
     unsigned int get_total_seed_count(void)const
     {
         if(seed_count.empty())
@@ -66,18 +70,28 @@ public:
     }
     bool is_ended(void)
     {
-        if(running.empty())
-            return true;
-        return std::find(running.begin(),running.end(),1) == running.end();
+        for(unsigned int i = 0;i < threads.size();++i)
+            if(threads[i]->wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return false;
+        return true;
     }
 
 public:
     std::vector<std::vector<float> > track_buffer;
-    void push_tracts(std::vector<std::vector<float> >& local_tract_buffer);
     void end_thread(void);
-
+private:// threads claim chunks of consecutive seed ordinals, and the chunks are committed in ordinal order
+    static const unsigned int seed_chunk_size = 64;
+    unsigned int seed_ordinal_end;
+    std::atomic<unsigned int> claimed_chunk;
+    unsigned int next_chunk;
+    unsigned int committed_count;
+    std::map<unsigned int,std::vector<std::vector<float> > > pending_chunks;
+    std::atomic<bool> tracking_ended;
+    tracking packed_trk;
+    void track_seed(TrackingMethod* method,BatchTracking* batch,unsigned int ordinal,std::vector<std::vector<float> >& tracts);
+    void commit_chunk(unsigned int chunk,std::vector<std::vector<float> >& tracts);
 public:
-    void run_thread(TrackingMethod* method_ptr,unsigned int thread_count,unsigned int thread_id,unsigned int max_count);
+    void run_thread(TrackingMethod* method_ptr,unsigned int thread_id);
     bool fetchTracks(TractModel* handle);
     void setRegions(image::geometry<3> dim,
                     const std::vector<image::vector<3,short> >& points,
@@ -1488,13 +1488,14 @@ void TractModel::get_quantitative_info(std::string& result)
 
     if(handle->db.has_db()) // connectometry database
     {
-        std::vector<const float*> old_fa(fib->fa);
+        std::vector<const float*> old_fa(fib->get_fa_data()),subject_fa(old_fa);
         std::vector<std::vector<float> > fa_data;
         for(unsigned int subject_index = 0;subject_index < handle->db.num_subjects;++subject_index)
         {
             handle->db.get_subject_fa(subject_index,fa_data);
             for(unsigned int i = 0;i < fib->fib_num;++i)
-                fib->fa[i] = &(fa_data[i][0]);
+                subject_fa[i] = &(fa_data[i][0]);
+            fib->set_fa(subject_fa);
 
             data.clear();
             get_quantitative_data(data);
@@ -1502,7 +1503,7 @@ void TractModel::get_quantitative_info(std::string& result)
                 out << handle->db.subject_names[subject_index] << " " <<
                        titles[index] << "\t" << data[index] << std::endl;
         }
-        fib->fa = old_fa;
+        fib->set_fa(old_fa);
     }
     result = out.str();
 }
@@ -1852,16 +1853,22 @@ void ConnectivityMatrix::set_atlas(atlas& data,const image::basic_image<image::v
 {
     image::geometry<3> geo(mni_position.geometry());
     image::vector<3> null;
+    image::basic_image<unsigned char,3> mask(geo);
+    for(unsigned int index = 0;index < mask.size();++index)
+        mask[index] = (mni_position[index] != null);
+    image::basic_image<uint64_t,3> label_volume;
+    std::vector<std::vector<unsigned int> > region_voxels;
+    data.get_label_volume(mni_position,label_volume);
+    data.get_region_voxels(label_volume,region_voxels,&mask);
     regions.clear();
     region_name.clear();
-    for (unsigned int label_index = 0; label_index < data.get_list().size(); ++label_index)
-    {
-        std::vector<image::vector<3,short> > cur_region;
-        for (image::pixel_index<3> index(geo); index < geo.size();++index)
-            if(mni_position[index.index()] != null &&
-               data.label_matched(data.get_label_at(mni_position[index.index()]),label_index))
-                cur_region.push_back(image::vector<3,short>(index.begin()));
-        regions.push_back(cur_region);
+    regions.resize(region_voxels.size());
+    for (unsigned int label_index = 0; label_index < region_voxels.size(); ++label_index)
+    {
+        const std::vector<unsigned int>& voxels = region_voxels[label_index];
+        regions[label_index].resize(voxels.size());
+        for(unsigned int i = 0;i < voxels.size();++i)
+            regions[label_index][i] = image::vector<3,short>(image::pixel_index<3>(voxels[i],geo).begin());
         region_name.push_back(data.get_list()[label_index]);
     }
 }
@@ -1,5 +1,8 @@
 #include <cstdlib>     /* srand, rand */
 #include <ctime>
+#include <cstdio>
+#include <thread>
+#include <numeric>
 #include "vbc_database.h"
 #include "fib_data.hpp"
 #include "libs/tracking/tract_model.hpp"
@@ -14,7 +17,9 @@ vbc_database::vbc_database():handle(0),roi_type(0),normalize_qa(true)
 bool vbc_database::create_database(const char* template_name)
 {
     handle.reset(new fib_data);
-    if(!handle->load_from_file(template_name))
+    // the subjects of a template database are streamed from its file when the
+    // new subjects are appended (connectometry_db::write_subject_files)
+    if(!handle->load_from_file(template_name,"subject0"))
     {
         error_msg = handle->error_msg;
         return false;
@@ -37,11 +42,19 @@ bool vbc_database::load_database(const char* database_name)
 }
 
 
-int vbc_database::run_track(const tracking& fib,std::vector<std::vector<float> >& tracks,float seed_ratio, unsigned int thread_count)
+int vbc_database::run_track(const tracking& fib,std::vector<std::vector<float> >& tracks,float seed_ratio, unsigned int thread_count,
+                           const std::vector<unsigned int>* seed_voxels)
 {
     std::vector<image::vector<3,short> > seed;
+    if(seed_voxels)
+        for(unsigned int i = 0;i < seed_voxels->size();++i)
+        {
+            image::pixel_index<3> index((*seed_voxels)[i],handle->dim);
+            seed.push_back(image::vector<3,short>(index.x(),index.y(),index.z()));
+        }
+    else
     for(image::pixel_index<3> index(handle->dim);index < handle->dim.size();++index)
-        if(fib.fa[0][index.index()] > fib.threshold)
+        if(fib.get_unpacked_fa(index.index(),0) > fib.threshold)
             seed.push_back(image::vector<3,short>(index.x(),index.y(),index.z()));
     unsigned int count = seed.size()*seed_ratio/1000.0;
     if(!count)
@@ -115,7 +128,16 @@ bool vbc_database::read_subject_data(const std::vector<std::string>& files,std::
     return true;
 }
 
-void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count)
+// Each permutation draws from its own random stream, seeded by the permutation index,
+// so the null distribution does not depend on the thread count or on the order in
+// which the permutations are run, and an interrupted run can be resumed.
+void permutation_stream(std::mt19937& gen,unsigned int permutation,bool null,unsigned int stream)
+{
+    std::seed_seq seq{permutation,null ? 1u:0u,stream};
+    gen.seed(seq);
+}
+
+void vbc_database::run_permutation_multithread(unsigned int thread_count,unsigned int permutation_count)
 {
     connectometry_result data;
     tracking fib;
@@ -124,103 +146,96 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
     fib.cull_cos_angle = std::cos(60 * 3.1415926 / 180.0);
     float voxel_density = seeding_density*fib.vs[0]*fib.vs[1]*fib.vs[2];
     std::vector<std::vector<float> > tracks;
-
-    if(model->type == 2) // individual
+    std::mt19937 gen;
+    // values under the tracking threshold never reach the tracking, so the permuted
+    // SPMs keep only the voxels at or above it, in a sparse result when possible
+    std::vector<unsigned int> seed_voxels;
+    auto track_result = [&](bool greater_result,unsigned int track_thread_count)->int
     {
-
-
-        bool null = true;
-        for(int i = id;i < permutation_count && !terminated;)
+        if(!data.is_sparse())
         {
-
-            for(unsigned int subject_id = 0;subject_id < individual_data.size() && !terminated;++subject_id)
-            {
-                stat_model info;
-                info.resample(*model.get(),null,true);
-                if(null)
-                {
-                    unsigned int random_subject_id = model->rand_gen(model->subject_index.size());
-                    info.individual_data = handle->db.subject_qa[random_subject_id];
-                    info.individual_data_sd = normalize_qa ? handle->db.subject_qa_sd[random_subject_id]:1.0;
-                }
-                else
-                {
-                    info.individual_data = &(individual_data[subject_id][0]);
-                    info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
-                }
-                calculate_spm(data,info,normalize_qa);
-                fib.fa = data.lesser_ptr;
-                run_track(fib,tracks,voxel_density);
-                cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
-
-                if(output_resampling && !null)
-                {
-                    std::lock_guard<std::mutex> lock(lock_lesser_tracks);
-                    lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
-                    tracks.clear();
-                }
-
-
-                fib.fa = data.greater_ptr;
-                run_track(fib,tracks,voxel_density);
-                cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
-
-                if(output_resampling && !null)
-                {
-                    std::lock_guard<std::mutex> lock(lock_greater_tracks);
-                    greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
-                    tracks.clear();
-                }
-
-            }
-            if(!null)
-            {
-                i += thread_count;
-                if(id == 0)
-                    progress = i*100/permutation_count;
-            }
-            null = !null;
+            fib.set_fa(greater_result ? data.greater_ptr : data.lesser_ptr);
+            return run_track(fib,tracks,voxel_density,track_thread_count);
         }
-        if(id == 0)
-        for(unsigned int subject_id = 0;subject_id < individual_data.size() && !terminated;++subject_id)
+        fib.set_fa(greater_result ? data.greater_ptr : data.lesser_ptr,&handle->db.vi2si[0],handle->dir.fa[0]);
+        data.get_sparse_seeds(handle,greater_result,fib.threshold,seed_voxels);
+        return run_track(fib,tracks,voxel_density,track_thread_count,&seed_voxels);
+    };
+    // results of one permutation, merged only when the permutation completes
+    std::vector<unsigned int> greater_null(subject_greater_null.size()),lesser_null(subject_lesser_null.size()),
+                              greater(subject_greater.size()),lesser(subject_lesser.size());
+    try{
+    while(!terminated)
+    {
+        unsigned int todo_index = next_permutation++;
+        if(todo_index >= permutation_todo.size())
+            break;
+        unsigned int i = permutation_todo[todo_index];
+        // at the tail, the cores of the finished workers go to tracking
+        unsigned int track_thread_count = std::max<unsigned int>(1,
+                    thread_count/std::min<unsigned int>(thread_count,permutation_todo.size()-todo_index));
+        std::fill(greater_null.begin(),greater_null.end(),0);
+        std::fill(lesser_null.begin(),lesser_null.end(),0);
+        std::fill(greater.begin(),greater.end(),0);
+        std::fill(lesser.begin(),lesser.end(),0);
+        unsigned int seed_lesser_null_count = 0,seed_greater_null_count = 0,
+                     seed_lesser_count = 0,seed_greater_count = 0;
+        for(unsigned int pass = 0;pass < 2 && !terminated;++pass)
         {
-            stat_model info;
-            info.resample(*model.get(),false,false);
-            info.individual_data = &(individual_data[subject_id][0]);
-            info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
-            calculate_spm(*spm_maps[subject_id],info,normalize_qa);
-            if(terminated)
-                return;
-            if(!output_resampling)
+            bool null = (pass == 0);
+            if(model->type == 2) // individual
             {
-                fib.fa = spm_maps[subject_id]->lesser_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
-                lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
-                fib.fa = spm_maps[subject_id]->greater_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
-                greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                for(unsigned int subject_id = 0;subject_id < individual_data.size() && !terminated;++subject_id)
+                {
+                    permutation_stream(gen,i,null,subject_id);
+                    stat_model info;
+                    info.resample(*model.get(),null,true,gen);
+                    if(null)
+                    {
+                        unsigned int random_subject_id = std::uniform_int_distribution<unsigned int>(0,model->subject_index.size()-1)(gen);
+                        info.individual_data = handle->db.subject_qa[random_subject_id];
+                        info.individual_data_sd = normalize_qa ? handle->db.subject_qa_sd[random_subject_id]:1.0;
+                    }
+                    else
+                    {
+                        info.individual_data = &(individual_data[subject_id][0]);
+                        info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
+                    }
+                    calculate_spm(data,info,normalize_qa,tracking_threshold);
+                    track_result(false,track_thread_count);
+                    cal_hist(tracks,(null) ? lesser_null : lesser);
+
+                    if(output_resampling && !null)
+                    {
+                        std::lock_guard<std::mutex> lock(lock_lesser_tracks);
+                        lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                        tracks.clear();
+                    }
+
+                    track_result(true,track_thread_count);
+                    cal_hist(tracks,(null) ? greater_null : greater);
+
+                    if(output_resampling && !null)
+                    {
+                        std::lock_guard<std::mutex> lock(lock_greater_tracks);
+                        greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                        tracks.clear();
+                    }
+                }
+                continue;
             }
-        }
-    }
-    else
-    {
-
-        bool null = true;
-        for(int i = id;i < permutation_count && !terminated;)
-        {
-
             stat_model info;
-            info.resample(*model.get(),null,true);
-            calculate_spm(data,info,normalize_qa);
+            permutation_stream(gen,i,null,0);
+            info.resample(*model.get(),null,true,gen);
+            calculate_spm(data,info,normalize_qa,tracking_threshold);
 
-            fib.fa = data.lesser_ptr;
-            unsigned int s = run_track(fib,tracks,voxel_density);
+            unsigned int s = track_result(false,track_thread_count);
             if(null)
-                seed_lesser_null[i] = s;
+                seed_lesser_null_count = s;
             else
-                seed_lesser[i] = s;
+                seed_lesser_count = s;
 
-            cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
+            cal_hist(tracks,(null) ? lesser_null : lesser);
 
             if(output_resampling && !null)
             {
@@ -229,15 +244,15 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
                 tracks.clear();
             }
 
-            info.resample(*model.get(),null,true);
-            calculate_spm(data,info,normalize_qa);
-            fib.fa = data.greater_ptr;
-            s = run_track(fib,tracks,voxel_density);
+            permutation_stream(gen,i,null,1);
+            info.resample(*model.get(),null,true,gen);
+            calculate_spm(data,info,normalize_qa,tracking_threshold);
+            s = track_result(true,track_thread_count);
             if(null)
-                seed_greater_null[i] = s;
+                seed_greater_null_count = s;
             else
-                seed_greater[i] = s;
-            cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
+                seed_greater_count = s;
+            cal_hist(tracks,(null) ? greater_null : greater);
 
             if(output_resampling && !null)
             {
@@ -245,37 +260,247 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
                 greater_tracks[0]->add_tracts(tracks,length_threshold);
                 tracks.clear();
             }
-
-            if(!null)
-            {
-                i += thread_count;
-                if(id == 0)
-                    progress = i*100/permutation_count;
-            }
-            null = !null;
         }
-        if(id == 0)
+        if(terminated)
+            break;
+        std::lock_guard<std::mutex> lock(lock_permutation);
+        image::add(subject_greater_null.begin(),subject_greater_null.end(),greater_null.begin());
+        image::add(subject_lesser_null.begin(),subject_lesser_null.end(),lesser_null.begin());
+        image::add(subject_greater.begin(),subject_greater.end(),greater.begin());
+        image::add(subject_lesser.begin(),subject_lesser.end(),lesser.begin());
+        if(model->type != 2)
         {
-            stat_model info;
-            info.resample(*model.get(),false,false);
-            calculate_spm(*spm_maps[0],info,normalize_qa);
+            seed_lesser_null[i] = seed_lesser_null_count;
+            seed_greater_null[i] = seed_greater_null_count;
+            seed_lesser[i] = seed_lesser_count;
+            seed_greater[i] = seed_greater_count;
+        }
+        permutation_done[i] = 1;
+        ++permutation_done_count;
+        progress = std::min<unsigned int>(99,permutation_done_count*100/permutation_count);
+        if(!checkpoint_file.empty() &&
+           std::chrono::steady_clock::now()-last_checkpoint > std::chrono::minutes(1))
+            save_checkpoint(permutation_count);
+    }
+    }
+    catch(std::runtime_error& e)
+    {
+        std::lock_guard<std::mutex> lock(lock_permutation);
+        error_msg = e.what();
+        terminated = true;
+    }
+}
 
-            if(terminated)
-                return;
-            if(!output_resampling)
-            {
-                fib.fa = spm_maps[0]->lesser_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
-                lesser_tracks[0]->add_tracts(tracks,length_threshold);
-                fib.fa = spm_maps[0]->greater_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
-                greater_tracks[0]->add_tracts(tracks,length_threshold);
-            }
+void vbc_database::run_permutation_scheduler(unsigned int thread_count,unsigned int permutation_count)
+{
+    // a fixed pool takes the permutations one at a time
+    std::vector<std::thread> pool;
+    for(unsigned int index = 1;index < thread_count;++index)
+        pool.push_back(std::thread([this,thread_count,permutation_count](){run_permutation_multithread(thread_count,permutation_count);}));
+    run_permutation_multithread(thread_count,permutation_count);
+    for(unsigned int index = 0;index < pool.size();++index)
+        pool[index].join();
+    if(terminated)
+    {
+        if(!checkpoint_file.empty())
+            save_checkpoint(permutation_count);
+        return;
+    }
+
+    // the actual result, tracked with all the cores
+    connectometry_result data;
+    tracking fib;
+    fib.read(*handle);
+    fib.threshold = tracking_threshold;
+    fib.cull_cos_angle = std::cos(60 * 3.1415926 / 180.0);
+    float voxel_density = seeding_density*fib.vs[0]*fib.vs[1]*fib.vs[2];
+    std::vector<std::vector<float> > tracks;
+    for(unsigned int subject_id = 0;subject_id < spm_maps.size() && !terminated;++subject_id)
+    {
+        stat_model info;
+        info.resample(*model.get(),false,false);
+        if(model->type == 2) // individual
+        {
+            info.individual_data = &(individual_data[subject_id][0]);
+            info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
+        }
+        calculate_spm(*spm_maps[subject_id],info,normalize_qa);
+        if(terminated)
+            return;
+        if(!output_resampling)
+        {
+            fib.set_fa(spm_maps[subject_id]->lesser_ptr);
+            run_track(fib,tracks,voxel_density*permutation_count,thread_count);
+            lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
+            fib.set_fa(spm_maps[subject_id]->greater_ptr);
+            run_track(fib,tracks,voxel_density*permutation_count,thread_count);
+            greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
         }
     }
-    if(id == 0 && !terminated)
+    if(!terminated)
+    {
+        if(!checkpoint_file.empty())
+            std::remove(checkpoint_file.c_str());
         progress = 100;
+    }
+}
+
+template<class value_type>
+void write_checkpoint(gz_mat_write& out,const char* name,const std::vector<value_type>& data)
+{
+    std::vector<int> buf(data.begin(),data.end());
+    if(!buf.empty())
+        out.write(name,&buf[0],1,(unsigned int)buf.size());
 }
+template<class value_type>
+bool read_checkpoint(gz_mat_read& in,const char* name,std::vector<value_type>& data)
+{
+    unsigned int row,col;
+    const int* buf = 0;
+    if(data.empty())
+        return true;
+    if(!in.read(name,row,col,buf) || row*col != data.size())
+        return false;
+    std::copy(buf,buf+data.size(),data.begin());
+    return true;
+}
+
+// The db file name, the subject names, the db size and the sum of each subject's
+// data. A checkpoint of another db, or of a db with subjects removed or replaced,
+// does not match.
+void vbc_database::get_checkpoint_db(void)
+{
+    const connectometry_db& db = handle->db;
+    std::ostringstream out;
+    out << handle->fib_file_name.substr(handle->fib_file_name.find_last_of("/\\")+1) << std::endl
+        << db.si2vi.size() << " " << db.subject_qa_length << " " << db.num_subjects << std::endl;
+    for(unsigned int index = 0;index < db.subject_names.size();++index)
+        out << db.subject_names[index] << std::endl;
+    checkpoint_db = out.str();
+    checkpoint_db_sum.clear();
+    checkpoint_db_sum.resize(db.num_subjects+individual_data.size());
+    image::par_for(checkpoint_db_sum.size(),[&](int index)
+    {
+        if((unsigned int)index < db.num_subjects)
+            checkpoint_db_sum[index] = std::accumulate(db.subject_qa[index],db.subject_qa[index]+db.subject_qa_length,0.0);
+        else
+        {
+            const std::vector<float>& data = individual_data[index-db.num_subjects];
+            checkpoint_db_sum[index] = std::accumulate(data.begin(),data.end(),0.0);
+        }
+    });
+}
+
+// Only completed permutations are stored, together with the db, the design and the
+// tracking setting, so a checkpoint of a different analysis is never resumed.
+bool vbc_database::save_checkpoint(unsigned int permutation_count)
+{
+    if(output_resampling) // the resampled tracks are not kept in the checkpoint
+        return false;
+    last_checkpoint = std::chrono::steady_clock::now();
+    std::string temp_file = gz_temp_file_name(checkpoint_file);
+    {
+        gz_mat_write out(temp_file.c_str());
+        if(!out)
+            return false;
+        std::vector<unsigned int> design;
+        design.push_back(permutation_count);
+        design.push_back(model->type);
+        design.push_back(model->threshold_type);
+        design.push_back(model->study_feature);
+        design.push_back(normalize_qa ? 1:0);
+        design.push_back(track_trimming);
+        design.push_back(individual_data.size());
+        write_checkpoint(out,"design",design);
+        write_checkpoint(out,"subject_index",model->subject_index);
+        write_checkpoint(out,"label",model->label);
+        write_checkpoint(out,"paired",model->paired);
+        if(!model->X.empty())
+            out.write("X",&model->X[0],1,(unsigned int)model->X.size());
+        float setting[] = {tracking_threshold,seeding_density,length_threshold,fiber_threshold};
+        out.write("setting",setting,1,4);
+        out.write("db",checkpoint_db.c_str(),1,(unsigned int)checkpoint_db.length());
+        if(!checkpoint_db_sum.empty())
+            out.write("db_sum",&checkpoint_db_sum[0],1,(unsigned int)checkpoint_db_sum.size());
+        write_checkpoint(out,"permutation_done",permutation_done);
+        write_checkpoint(out,"subject_greater_null",subject_greater_null);
+        write_checkpoint(out,"subject_lesser_null",subject_lesser_null);
+        write_checkpoint(out,"subject_greater",subject_greater);
+        write_checkpoint(out,"subject_lesser",subject_lesser);
+        write_checkpoint(out,"seed_greater_null",seed_greater_null);
+        write_checkpoint(out,"seed_lesser_null",seed_lesser_null);
+        write_checkpoint(out,"seed_greater",seed_greater);
+        write_checkpoint(out,"seed_lesser",seed_lesser);
+    }
+    return gz_replace_file(temp_file,checkpoint_file);
+}
+
+bool vbc_database::load_checkpoint(unsigned int permutation_count)
+{
+    gz_mat_read in;
+    if(output_resampling || !in.load_from_file(checkpoint_file.c_str()))
+        return false;
+    std::vector<unsigned int> design(7),design_now;
+    design_now.push_back(permutation_count);
+    design_now.push_back(model->type);
+    design_now.push_back(model->threshold_type);
+    design_now.push_back(model->study_feature);
+    design_now.push_back(normalize_qa ? 1:0);
+    design_now.push_back(track_trimming);
+    design_now.push_back(individual_data.size());
+    std::vector<unsigned int> subject_index(model->subject_index.size());
+    std::vector<int> label(model->label.size());
+    std::vector<unsigned int> paired(model->paired.size());
+    if(!read_checkpoint(in,"design",design) || design != design_now ||
+       !read_checkpoint(in,"subject_index",subject_index) || subject_index != model->subject_index ||
+       !read_checkpoint(in,"label",label) || label != model->label ||
+       !read_checkpoint(in,"paired",paired) || paired != model->paired)
+        return false;
+    unsigned int row,col;
+    const double* X = 0;
+    const float* setting = 0;
+    if(!model->X.empty() &&
+       (!in.read("X",row,col,X) || row*col != model->X.size() || !std::equal(model->X.begin(),model->X.end(),X)))
+        return false;
+    if(!in.read("setting",row,col,setting) || row*col != 4 ||
+       setting[0] != tracking_threshold || setting[1] != seeding_density ||
+       setting[2] != length_threshold || setting[3] != fiber_threshold)
+        return false;
+    const char* db = 0;
+    const double* db_sum = 0;
+    if(!in.read("db",row,col,db) || std::string(db,db+row*col) != checkpoint_db)
+        return false;
+    if(!checkpoint_db_sum.empty() &&
+       (!in.read("db_sum",row,col,db_sum) || row*col != checkpoint_db_sum.size() ||
+        !std::equal(checkpoint_db_sum.begin(),checkpoint_db_sum.end(),db_sum)))
+        return false;
+    std::vector<unsigned char> done(permutation_count);
+    std::vector<unsigned int> greater_null(subject_greater_null.size()),lesser_null(subject_lesser_null.size()),
+                              greater(subject_greater.size()),lesser(subject_lesser.size());
+    std::vector<unsigned int> s_greater_null(permutation_count),s_lesser_null(permutation_count),
+                              s_greater(permutation_count),s_lesser(permutation_count);
+    if(!read_checkpoint(in,"permutation_done",done) ||
+       !read_checkpoint(in,"subject_greater_null",greater_null) ||
+       !read_checkpoint(in,"subject_lesser_null",lesser_null) ||
+       !read_checkpoint(in,"subject_greater",greater) ||
+       !read_checkpoint(in,"subject_lesser",lesser) ||
+       !read_checkpoint(in,"seed_greater_null",s_greater_null) ||
+       !read_checkpoint(in,"seed_lesser_null",s_lesser_null) ||
+       !read_checkpoint(in,"seed_greater",s_greater) ||
+       !read_checkpoint(in,"seed_lesser",s_lesser))
+        return false;
+    permutation_done.swap(done);
+    subject_greater_null.swap(greater_null);
+    subject_lesser_null.swap(lesser_null);
+    subject_greater.swap(greater);
+    subject_lesser.swap(lesser);
+    seed_greater_null.swap(s_greater_null);
+    seed_lesser_null.swap(s_lesser_null);
+    seed_greater.swap(s_greater);
+    seed_lesser.swap(s_lesser);
+    return true;
+}
+
 void vbc_database::clear(void)
 {
     if(!threads.empty())
@@ -335,7 +560,7 @@ void vbc_database::save_tracks_files(std::vector<std::string>& saved_file_name)
                 std::string name = handle->mat_reader.name(i);
                 if(name == "dimension" || name == "voxel_size" ||
                         name == "odf_vertices" || name == "odf_faces" || name == "trans")
-                    mat_write.write(handle->mat_reader[i]);
+                    handle->mat_reader.write_to(mat_write,i);
                 if(name == "fa0")
                     mat_write.write("qa_map",handle->dir.fa[0],1,handle->dim.size());
             }
@@ -382,7 +607,7 @@ void vbc_database::save_tracks_files(std::vector<std::string>& saved_file_name)
                 std::string name = handle->mat_reader.name(i);
                 if(name == "dimension" || name == "voxel_size" ||
                         name == "odf_vertices" || name == "odf_faces" || name == "trans")
-                    mat_write.write(handle->mat_reader[i]);
+                    handle->mat_reader.write_to(mat_write,i);
                 if(name == "fa0")
                     mat_write.write("qa_map",handle->dir.fa[0],1,handle->dim.size());
             }
@@ -442,10 +667,24 @@ void vbc_database::run_permutation(unsigned int thread_count,unsigned int permut
         spm_maps.push_back(std::make_shared<connectometry_result>());
     }
     clear();
-    progress = 0;
-    for(unsigned int index = 0;index < thread_count;++index)
-        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-            [this,index,thread_count,permutation_count](){run_permutation_multithread(index,thread_count,permutation_count);})));
+    permutation_done.clear();
+    permutation_done.resize(permutation_count);
+    if(!checkpoint_file.empty())
+    {
+        get_checkpoint_db();
+        load_checkpoint(permutation_count);
+    }
+    permutation_todo.clear();
+    for(unsigned int index = 0;index < permutation_count;++index)
+        if(!permutation_done[index])
+            permutation_todo.push_back(index);
+    next_permutation = 0;
+    permutation_done_count = permutation_count-permutation_todo.size();
+    last_checkpoint = std::chrono::steady_clock::now();
+    progress = std::min<unsigned int>(99,permutation_done_count*100/std::max<unsigned int>(1,permutation_count));
+    thread_count = std::max<unsigned int>(1,thread_count);
+    threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
+        [this,thread_count,permutation_count](){run_permutation_scheduler(thread_count,permutation_count);})));
 }
 void vbc_database::calculate_FDR(void)
 {
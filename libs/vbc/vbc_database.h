@@ -2,6 +2,8 @@
 #define VBC_DATABASE_H
 #include <vector>
 #include <iostream>
+#include <atomic>
+#include <chrono>
 #include "image/image.hpp"
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
@@ -33,12 +35,13 @@ public:// database information
     bool normalize_qa;
     bool output_resampling;
 public:
-    void calculate_spm(connectometry_result& data,stat_model& info,bool nqa)
+    void calculate_spm(connectometry_result& data,stat_model& info,bool nqa,float result_threshold = 0.0f)
     {
-        ::calculate_spm(handle,data,info,fiber_threshold,nqa,terminated);
+        ::calculate_spm(handle,data,info,fiber_threshold,nqa,terminated,result_threshold);
     }
 private: // single subject analysis result
-    int run_track(const tracking& fib,std::vector<std::vector<float> >& track,float seed_ratio = 1.0,unsigned int thread_count = 1);
+    int run_track(const tracking& fib,std::vector<std::vector<float> >& track,float seed_ratio = 1.0,unsigned int thread_count = 1,
+                  const std::vector<unsigned int>* seed_voxels = 0);
 public:// for FDR analysis
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> subject_greater_null;
@@ -75,8 +78,23 @@ public:// Multiple regression
     float tracking_threshold;
     float length_threshold;
     unsigned int track_trimming;
-    void run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count);
+    void run_permutation_multithread(unsigned int thread_count,unsigned int permutation_count);
+    void run_permutation_scheduler(unsigned int thread_count,unsigned int permutation_count);
     void run_permutation(unsigned int thread_count,unsigned int permutation_count);
+public:// permutation scheduling and checkpoint
+    std::string checkpoint_file;
+    std::vector<unsigned int> permutation_todo;
+    std::vector<unsigned char> permutation_done;
+    std::atomic<unsigned int> next_permutation;
+    unsigned int permutation_done_count;
+    std::mutex lock_permutation;
+    std::chrono::steady_clock::time_point last_checkpoint;
+    // identifies the db and the individual data of a checkpoint
+    std::string checkpoint_db;
+    std::vector<double> checkpoint_db_sum;
+    void get_checkpoint_db(void);
+    bool save_checkpoint(unsigned int permutation_count);
+    bool load_checkpoint(unsigned int permutation_count);
     void calculate_FDR(void);
 public:
 };
@@ -2,6 +2,7 @@
 #include <iterator>
 #include <string>
 #include <cstdio>
+#include <thread>
 #include <QApplication>
 #include <QMessageBox>
 #include <QStyleFactory>
@@ -28,6 +29,7 @@ int atl(void);
 int cnt(void);
 int vis(void);
 int ren(void);
+extern unsigned int gz_thread_count;
 
 
 QStringList search_files(QString dir,QString filter)
@@ -58,6 +60,7 @@ int run_cmd(void)
             return 1;
         }
         QDir::setCurrent(QFileInfo(po.get("action").c_str()).absolutePath());
+        gz_thread_count = std::max<int>(1,po.get("gz_thread_count",po.get("thread_count",int(std::thread::hardware_concurrency()))));
         if(po.get("action") == std::string("rec"))
             return rec();
         if(po.get("action") == std::string("trk"))
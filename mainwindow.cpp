@@ -589,7 +589,7 @@ void MainWindow::on_warpImage_clicked()
     }
 }
 */
-bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
+bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool defer_image,unsigned int thread_count);
 bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
 QString get_src_name(QString file_name);
 
@@ -661,7 +661,7 @@ void MainWindow::on_batch_src_clicked()
                 if(!choice)
                     continue;
             }
-            if(!load_all_files(dicom_file_list,dwi_files) || prog_aborted())
+            if(!load_all_files(dicom_file_list,dwi_files,false,std::thread::hardware_concurrency()) || prog_aborted())
                 continue;
             if(dwi_files.size() == 1) //MPRAGE or T2W
             {
@@ -2,6 +2,7 @@
 #include <QStringListModel>
 #include <QMessageBox>
 #include <fstream>
+#include <thread>
 #include "vbcdialog.h"
 #include "ui_vbcdialog.h"
 #include "fib_data.hpp"
@@ -266,12 +267,13 @@ void VBCDialog::on_create_data_base_clicked()
             name_list[index] = group[index].toLocal8Bit().begin();
             tag_list[index] = QFileInfo(group[index]).baseName().toLocal8Bit().begin();
         }
-        if(!data->handle->db.load_subject_files(name_list,tag_list,ui->index_of_interest->currentText().toLocal8Bit().begin()))
+        if(!data->handle->db.save_subject_files(name_list,tag_list,ui->index_of_interest->currentText().toLocal8Bit().begin(),
+                                                ui->output_file_name->text().toLocal8Bit().begin(),
+                                                std::thread::hardware_concurrency()))
         {
             QMessageBox::information(this,"error in loading subject fib files",data->handle->error_msg.c_str(),0);
             return;
         }
-        data->handle->db.save_subject_data(ui->output_file_name->text().toLocal8Bit().begin());
         QMessageBox::information(this,"completed","Connectometry database created",0);
     }
     else
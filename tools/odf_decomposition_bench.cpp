@@ -0,0 +1,310 @@
+/*
+ Benchmark of the ODF decomposition in libs/dsi/odf_decomposition.hpp.
+
+ Synthetic one- and two-fiber ODFs with noise are decomposed by
+ sparse_odf_solver and by the previous per-voxel algorithm (a lasso that
+ recomputes Rt·residual at every step, followed by a least-squares fit that
+ rebuilds the active matrix at every drop). The program reports the time of
+ both and how many voxels end up with the same directions.
+
+ It only needs the standard library:
+   g++ -O2 -std=c++11 -I../libs/dsi odf_decomposition_bench.cpp -o odf_decomposition_bench
+   ./odf_decomposition_bench [voxel_count=2000] [direction_count=321]
+ */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include "sparse_odf_solver.hpp"
+
+const float decomposition_fraction = 0.05f;
+const unsigned int max_fiber = 10;
+
+struct decomposition{
+    std::vector<int> dir_list;
+    std::vector<float> results;
+    int has_isotropic;
+};
+
+template<class iterator_type>
+void normalize_vector(iterator_type from,iterator_type to)
+{
+    float mean = std::accumulate(from,to,0.0)/((float)(to-from));
+    double length2 = 0.0;
+    for(iterator_type iter = from;iter != to;++iter)
+    {
+        *iter -= mean;
+        length2 += *iter * *iter;
+    }
+    float length = std::sqrt(length2);
+    if(length+1.0 != 1.0)
+        for(iterator_type iter = from;iter != to;++iter)
+            *iter /= length;
+}
+
+// the previous lasso: the correlations are recomputed from the residual at every step
+void reference_lasso(const std::vector<float>& y,const std::vector<float>& x,std::vector<float>& w)
+{
+    unsigned int n = y.size();
+    std::vector<float> residual(y),corr(n);
+    std::vector<char> fib_map(n);
+    w.assign(n,0.0f);
+    unsigned int max_iter = ((float)max_fiber/decomposition_fraction);
+    unsigned int total_fiber = 0;
+    for(unsigned int fib_index = 0;fib_index < max_iter;++fib_index)
+    {
+        for(unsigned int i = 0;i < n;++i)
+            corr[i] = std::inner_product(x.begin()+i*n,x.begin()+(i+1)*n,residual.begin(),0.0f);
+        unsigned int dir = std::max_element(corr.begin(),corr.end())-corr.begin();
+        if(corr[dir] < 0.0)
+            break;
+        if(!fib_map[dir])
+        {
+            total_fiber++;
+            if(total_fiber > max_fiber)
+                break;
+            fib_map[dir] = 1;
+        }
+        const float* xi = &x[dir*n];
+        float step = corr[dir]*decomposition_fraction;
+        if(fib_index == 0)
+        {
+            step = std::numeric_limits<float>::max();
+            for(unsigned int j = 0;j < n;++j)
+            {
+                if(j == dir)
+                    continue;
+                const float* xj = &x[j*n];
+                float t1 = 0.0f,t2 = 0.0f;
+                for(unsigned int i = 0;i < n;++i)
+                {
+                    float dif = xi[i]-xj[i];
+                    t1 += dif*residual[i];
+                    t2 += dif*xi[i];
+                }
+                float value = (t2 + 1.0 == 1.0) ? 0.0f : t1/t2;
+                if(value < step)
+                    step = value;
+            }
+        }
+        w[dir] += step;
+        for(unsigned int i = 0;i < n;++i)
+            residual[i] -= step*xi[i];
+    }
+}
+
+// least squares of the k rows in A (k x n) against b, through the normal equations
+void least_squares(const std::vector<float>& A,const std::vector<float>& b,std::vector<float>& x,unsigned int k)
+{
+    unsigned int n = b.size();
+    std::vector<double> M(k*k),r(k);
+    for(unsigned int i = 0;i < k;++i)
+    {
+        for(unsigned int j = 0;j < k;++j)
+            M[i*k+j] = std::inner_product(A.begin()+i*n,A.begin()+(i+1)*n,A.begin()+j*n,0.0);
+        r[i] = std::inner_product(A.begin()+i*n,A.begin()+(i+1)*n,b.begin(),0.0);
+    }
+    for(unsigned int c = 0;c < k;++c)
+    {
+        unsigned int p = c;
+        for(unsigned int i = c+1;i < k;++i)
+            if(std::fabs(M[i*k+c]) > std::fabs(M[p*k+c]))
+                p = i;
+        for(unsigned int j = 0;j < k;++j)
+            std::swap(M[c*k+j],M[p*k+j]);
+        std::swap(r[c],r[p]);
+        for(unsigned int i = c+1;i < k;++i)
+        {
+            double f = M[i*k+c]/M[c*k+c];
+            for(unsigned int j = c;j < k;++j)
+                M[i*k+j] -= f*M[c*k+j];
+            r[i] -= f*r[c];
+        }
+    }
+    x.resize(k);
+    for(int i = k-1;i >= 0;--i)
+    {
+        double sum = r[i];
+        for(unsigned int j = i+1;j < k;++j)
+            sum -= M[i*k+j]*x[j];
+        x[i] = sum/M[i*k+i];
+    }
+}
+
+// the previous fit: the active matrix is rebuilt and solved again after every drop
+void reference_decomposition(const std::vector<float>& odf,const std::vector<float>& Rt,const std::vector<float>& oRt,
+                             const std::vector<std::vector<unsigned char> >& is_neighbor,decomposition& result)
+{
+    unsigned int n = odf.size();
+    std::vector<float> y(odf),w;
+    normalize_vector(y.begin(),y.end());
+    reference_lasso(y,Rt,w);
+    std::vector<int>& dir_list = result.dir_list;
+    std::vector<float>& results = result.results;
+    dir_list.clear();
+    for(unsigned int index = 0;index < n;++index)
+        if(w[index] > 0.0)
+            dir_list.push_back(index);
+    int has_isotropic = 1;
+    while(1)
+    {
+        if(dir_list.empty())
+        {
+            results.assign(1,std::accumulate(odf.begin(),odf.end(),0.0)/n);
+            has_isotropic = 1;
+            break;
+        }
+        std::vector<float> RRt;
+        if(has_isotropic)
+            RRt.assign(n,1.0f);
+        for(unsigned int index = 0;index < dir_list.size();++index)
+            RRt.insert(RRt.end(),oRt.begin()+dir_list[index]*n,oRt.begin()+(dir_list[index]+1)*n);
+        least_squares(RRt,odf,results,dir_list.size()+has_isotropic);
+
+        int min_index = std::min_element(results.begin()+has_isotropic,results.end())-results.begin();
+        if(results[min_index] < 0.0)
+        {
+            dir_list.erase(dir_list.begin()+min_index-has_isotropic);
+            continue;
+        }
+        if(has_isotropic && results[0] < 0.0)
+        {
+            has_isotropic = 0;
+            continue;
+        }
+        int smallest_neighbor = -1;
+        float value = 0.0;
+        for(unsigned int i = 0;i < dir_list.size();++i)
+            for(unsigned int j = i+1;j < dir_list.size();++j)
+                if(is_neighbor[dir_list[i]][dir_list[j]])
+                {
+                    if(smallest_neighbor == -1 || results[i+has_isotropic] < value)
+                    {
+                        smallest_neighbor = i;
+                        value = results[i+has_isotropic];
+                    }
+                    if(results[j+has_isotropic] < value)
+                    {
+                        smallest_neighbor = j;
+                        value = results[j+has_isotropic];
+                    }
+                }
+        if(smallest_neighbor == -1)
+            break;
+        dir_list.erase(dir_list.begin()+smallest_neighbor);
+    }
+    result.has_isotropic = has_isotropic;
+}
+
+// fiber response as a function of the cosine to the fiber direction
+double fiber_profile(double cos_angle)
+{
+    return std::exp(-6.0*(1.0-cos_angle*cos_angle));
+}
+
+int main(int argc,char* argv[])
+{
+    unsigned int voxel_count = argc > 1 ? std::atoi(argv[1]) : 2000;
+    unsigned int n = argc > 2 ? std::atoi(argv[2]) : 321;
+
+    // directions on a hemisphere (Fibonacci lattice), each neighboring its six closest
+    std::vector<double> vx(n),vy(n),vz(n);
+    for(unsigned int i = 0;i < n;++i)
+    {
+        double z = 1.0-(i+0.5)/n,r = std::sqrt(1.0-z*z),phi = i*2.399963;
+        vx[i] = r*std::cos(phi);
+        vy[i] = r*std::sin(phi);
+        vz[i] = z;
+    }
+    auto cos_angle = [&](unsigned int i,double x,double y,double z){return vx[i]*x+vy[i]*y+vz[i]*z;};
+    std::vector<std::vector<unsigned char> > is_neighbor(n,std::vector<unsigned char>(n));
+    for(unsigned int i = 0;i < n;++i)
+    {
+        std::vector<std::pair<double,unsigned int> > dis;
+        for(unsigned int j = 0;j < n;++j)
+            if(j != i)
+                dis.push_back(std::make_pair(-std::fabs(cos_angle(j,vx[i],vy[i],vz[i])),j));
+        std::partial_sort(dis.begin(),dis.begin()+6,dis.end());
+        for(unsigned int k = 0;k < 6;++k)
+            is_neighbor[i][dis[k].second] = is_neighbor[dis[k].second][i] = 1;
+    }
+
+    // Rt: normalized responses for the lasso, oRt: responses scaled to a maximum of one
+    std::vector<float> Rt(n*n),oRt;
+    for(unsigned int i = 0;i < n;++i)
+        for(unsigned int j = 0;j < n;++j)
+            Rt[i*n+j] = fiber_profile(cos_angle(i,vx[j],vy[j],vz[j]));
+    oRt = Rt;
+    for(unsigned int i = 0;i < n;++i)
+    {
+        normalize_vector(Rt.begin()+i*n,Rt.begin()+(i+1)*n);
+        float max_value = *std::max_element(oRt.begin()+i*n,oRt.begin()+(i+1)*n);
+        for(unsigned int j = 0;j < n;++j)
+            oRt[i*n+j] /= max_value;
+    }
+
+    // one fiber in every third voxel, two crossing fibers in the others
+    std::mt19937 gen(7);
+    std::normal_distribution<double> normal;
+    std::uniform_real_distribution<double> uniform(0.0,1.0);
+    std::vector<std::vector<float> > odfs(voxel_count,std::vector<float>(n));
+    for(unsigned int k = 0;k < voxel_count;++k)
+    {
+        double d[2][3];
+        for(unsigned int f = 0;f < 2;++f)
+        {
+            for(unsigned int c = 0;c < 3;++c)
+                d[f][c] = normal(gen);
+            double length = std::sqrt(d[f][0]*d[f][0]+d[f][1]*d[f][1]+d[f][2]*d[f][2]);
+            for(unsigned int c = 0;c < 3;++c)
+                d[f][c] /= length;
+        }
+        double iso = uniform(gen),a1 = 0.5+uniform(gen),a2 = (k % 3 == 0) ? 0.0 : 0.3+uniform(gen);
+        for(unsigned int i = 0;i < n;++i)
+            odfs[k][i] = iso+a1*fiber_profile(cos_angle(i,d[0][0],d[0][1],d[0][2]))
+                            +a2*fiber_profile(cos_angle(i,d[1][0],d[1][1],d[1][2]))+0.02*normal(gen);
+    }
+
+    std::vector<decomposition> reference(voxel_count);
+    auto t0 = std::chrono::steady_clock::now();
+    for(unsigned int k = 0;k < voxel_count;++k)
+        reference_decomposition(odfs[k],Rt,oRt,is_neighbor,reference[k]);
+    auto t1 = std::chrono::steady_clock::now();
+
+    sparse_odf_solver solver;
+    solver.init(Rt,oRt,n,max_fiber,is_neighbor);
+    sparse_odf_solver::workspace ws;
+    solver.init(ws);
+    unsigned int same = 0,rank_deficient = 0;
+    double max_difference = 0.0;
+    for(unsigned int k = 0;k < voxel_count;++k)
+    {
+        ws.y = odfs[k];
+        normalize_vector(ws.y.begin(),ws.y.end());
+        solver.lasso(ws,decomposition_fraction,max_fiber);
+        if(!solver.fit(ws,&odfs[k][0]))
+        {
+            ++rank_deficient;
+            continue;
+        }
+        if(ws.dir_list != reference[k].dir_list || ws.has_isotropic != reference[k].has_isotropic)
+            continue;
+        ++same;
+        for(unsigned int i = 0;i < ws.results.size();++i)
+            max_difference = std::max<double>(max_difference,
+                std::fabs(ws.results[i]-reference[k].results[i])/(1.0e-3+std::fabs(reference[k].results[i])));
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    std::printf("%u voxels, %u directions\n",voxel_count,n);
+    std::printf("previous algorithm:  %.1f ms\n",std::chrono::duration<double,std::milli>(t1-t0).count());
+    std::printf("sparse_odf_solver:   %.1f ms\n",std::chrono::duration<double,std::milli>(t2-t1).count());
+    std::printf("same directions in %u voxels, largest relative weight difference %g\n",same,max_difference);
+    std::printf("rank deficient (falls back to the previous fit): %u\n",rank_deficient);
+    return 0;
+}
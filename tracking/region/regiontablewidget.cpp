@@ -144,10 +144,19 @@ QColor RegionTableWidget::currentRowColor(void)
 }
 void RegionTableWidget::add_region_from_atlas(unsigned int atlas,unsigned int label)
 {
-    std::vector<image::vector<3,short> > points;
-    cur_tracking_window.handle->get_atlas_roi(atlas,label,points);
-    add_region(atlas_list[atlas].get_list()[label].c_str(),roi_id);
-    add_points(points,false);
+    add_region_from_atlas(atlas,std::vector<unsigned int>(1,label));
+}
+void RegionTableWidget::add_region_from_atlas(unsigned int atlas,const std::vector<unsigned int>& labels)
+{
+    // the atlas is mapped to the subject space once for all labels
+    std::vector<std::vector<image::vector<3,short> > > points;
+    cur_tracking_window.handle->get_atlas_roi(atlas,points);
+    for(unsigned int i = 0;i < labels.size();++i)
+    {
+        add_region(atlas_list[atlas].get_list()[labels[i]].c_str(),roi_id);
+        if(labels[i] < points.size())
+            add_points(points[labels[i]],false);
+    }
 }
 
 void RegionTableWidget::add_region(QString name,unsigned char feature,int color)
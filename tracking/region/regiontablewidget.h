@@ -52,6 +52,7 @@ public:
     QColor currentRowColor(void);
     bool has_seeding(void);
     void add_region_from_atlas(unsigned int atlas_id,unsigned int roi_is);
+    void add_region_from_atlas(unsigned int atlas_id,const std::vector<unsigned int>& roi_list);
     void add_region(QString name,unsigned char type,int color = 0x00FFFFFF);
     void set_whole_brain(ThreadData* data);
     void setROIs(ThreadData* data);
@@ -1090,6 +1090,7 @@ void tracking_window::on_actionManual_Registration_triggered()
         return;
     handle->thread.clear();
     handle->reg = manual->data;
+    handle->update_mni_mapping();
 }
 
 
@@ -1240,8 +1241,7 @@ void tracking_window::on_addRegionFromAtlas_clicked()
     std::auto_ptr<AtlasDialog> atlas_dialog(new AtlasDialog(this));
     if(atlas_dialog->exec() == QDialog::Accepted)
     {
-        for(unsigned int i = 0;i < atlas_dialog->roi_list.size();++i)
-            regionWidget->add_region_from_atlas(atlas_dialog->atlas_index,atlas_dialog->roi_list[i]);
+        regionWidget->add_region_from_atlas(atlas_dialog->atlas_index,atlas_dialog->roi_list);
         glWidget->updateGL();
         scene.show_slice();
     }
@@ -1441,6 +1441,7 @@ void tracking_window::on_actionImprove_Quality_triggered()
             std::copy(new_fa[i].begin(),new_fa[i].begin()+size,(float*)handle->dir.fa[i]);
             std::copy(new_index[i].begin(),new_index[i].begin()+size,(short*)handle->dir.findex[i]);
         }
+        handle->clear_packed_records();
     }
     scene.show_slice();
 }
@@ -1289,6 +1289,11 @@ void vbc_dialog::on_run_clicked()
         << " randomized permutations were applied to the group label to obtain the null distribution of the track length.";
 
     vbc->report = out.str().c_str();
+    // an interrupted run of the same analysis resumes from here
+    if(checkpoint_file.empty())
+        vbc->checkpoint_file = vbc->trk_file_names[0] + ".permutation.gz";
+    else
+        vbc->checkpoint_file = (checkpoint_file == "0" ? std::string() : checkpoint_file);
     vbc->run_permutation(ui->multithread->value(),ui->mr_permutation->value());
     timer.reset(new QTimer(this));
     timer->setInterval(1000);
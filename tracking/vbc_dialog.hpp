@@ -55,6 +55,8 @@ private:
     void add_new_roi(QString name,QString source,std::vector<image::vector<3,short> >& new_roi);
 public:
     bool gui;
+    // permutation checkpoint, empty: next to the output files, "0": none
+    std::string checkpoint_file;
     QString work_dir,db_file_name;
     std::vector<std::string> file_names,saved_file_name;
 public: